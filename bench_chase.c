@@ -0,0 +1,143 @@
+/*
+ * bench_chase.c - random-access pointer chasing over allocated objects, to show what the TLB costs.
+ * Compare a default build against a -DHUGE_PAGES one:
+ *
+ *   cc -O2 -DHUGE_PAGES bench_chase.c memlib.c -o bench_chase
+ *   ./bench_chase 30000 2048 20000000     objects, object size, steps
+ *
+ * Objects get allocated, every third one freed and allocated again so the heap isn't a plain
+ * sequence, then linked into a single cycle in random order and chased. With few enough objects
+ * the lines touched stay in cache and what's left is mostly page walks, which huge pages remove.
+ * dTLB load misses get counted too where perf events are allowed.
+ */
+#include "memlib.h"
+#include "malloc.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+/*
+ * dtlb_counter - open a counter of the calling thread's dTLB read misses, or return -1 if perf
+ * events aren't available
+ */
+static int dtlb_counter(void) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long read_counter(int fd) {
+    long value = 0;
+    if (fd < 0 || read(fd, &value, sizeof(value)) != sizeof(value)) return -1;
+    return value;
+}
+
+/*
+ * huge_kb - how much of the process is in transparent huge pages right now
+ */
+static long huge_kb(void) {
+    char line[256];
+    long kb = 0;
+    FILE* f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL) return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (strncmp(line, "AnonHugePages:", 14) == 0) kb = atol(line + 14);
+    }
+    fclose(f);
+    return kb;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s objects object_size steps\n", argv[0]);
+        return 1;
+    }
+    long n = atol(argv[1]);
+    size_t size = atol(argv[2]);
+    long steps = atol(argv[3]);
+    if (n < 2 || size < sizeof(void*)) {
+        fprintf(stderr, "need at least 2 objects of at least %zu bytes\n", sizeof(void*));
+        return 1;
+    }
+
+    mem_init();
+    if (mm_init() == -1) {
+        fprintf(stderr, "mm_init failed\n");
+        return 1;
+    }
+
+    void** objs = malloc(n*sizeof(void*));
+    long* order = malloc(n*sizeof(long));
+    if (objs == NULL || order == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+    srand(1);
+    for (long i = 0; i < n; i++) {
+        objs[i] = mm_malloc(size);
+        if (objs[i] == NULL) {
+            fprintf(stderr, "mm_malloc(%zu) failed\n", size);
+            return 1;
+        }
+        memset(objs[i], 0, size);
+    }
+    for (long i = 0; i < n; i += 3) {
+        mm_free(objs[i]);
+    }
+    for (long i = 0; i < n; i += 3) {
+        objs[i] = mm_malloc(size);
+        if (objs[i] == NULL) {
+            fprintf(stderr, "mm_malloc(%zu) failed\n", size);
+            return 1;
+        }
+    }
+
+    //link every object to the next one of a random permutation, closing the cycle
+    for (long i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    for (long i = n - 1; i > 0; i--) {
+        long j = rand() % (i + 1);
+        long t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    for (long i = 0; i < n; i++) {
+        *(void**) objs[order[i]] = objs[order[(i + 1) % n]];
+    }
+
+    void* p = objs[0];
+    for (long i = 0; i < n; i++) { //once around first, so what fits in cache is there
+        p = *(void**) p;
+    }
+
+    int counter = dtlb_counter();
+    long misses = read_counter(counter);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < steps; i++) {
+        p = *(void**) p;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    if (misses >= 0) misses = read_counter(counter) - misses;
+
+    double ns = ((end.tv_sec - start.tv_sec)*1e9 + (end.tv_nsec - start.tv_nsec))/steps;
+    printf("objects=%ld size=%zu heap=%zuMB ns/step=%.1f", n, size, mem_heapsize() >> 20, ns);
+    if (misses >= 0) {
+        printf(" dtlb_misses/step=%.3f", (double) misses/steps);
+    } else {
+        printf(" dtlb_misses/step=n/a");
+    }
+    printf(" huge_pages=%ldMB%s\n", huge_kb() >> 10, p == NULL ? " (broken cycle)" : "");
+    return 0;
+}
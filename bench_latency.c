@@ -0,0 +1,112 @@
+/*
+ * bench_latency.c - per-call cost of mm_malloc, mm_free and mm_realloc, with the tail that
+ * latency-sensitive callers care about. Build it once per engine and compare:
+ *
+ *   for e in "" -DTLSF -DBUDDY -DADDRESS_ORDER; do
+ *       cc -O2 $e bench_latency.c memlib.c -o bench_latency && ./bench_latency 1000000 20000 30
+ *   done
+ *
+ * The arguments are operations, the most blocks live at once, and the percentage of operations on
+ * a live block that are reallocs rather than frees. Sizes are mixed: mostly small, some up to 4KB,
+ * a few up to 64KB. Every call is timed on its own, in TSC cycles on x86 and nanoseconds elsewhere.
+ * The maximum is mostly first-touch page faults on fresh heap memory, whatever the engine, so the
+ * high percentiles say more.
+ */
+#include "memlib.h"
+#include "malloc.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define UNIT "cycles"
+#define NOW() __rdtsc()
+#else
+#define UNIT "ns"
+static unsigned long long now_ns(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec*1000000000ull + t.tv_nsec;
+}
+#define NOW() now_ns()
+#endif
+
+static unsigned long long* SAMPLES; /* cost of every call so far */
+static long NUM_SAMPLES;
+
+/* Evaluate a call to the allocator and record what it cost */
+#define TIMED(call) do { \
+    unsigned long long t0 = NOW(); \
+    call; \
+    SAMPLES[NUM_SAMPLES++] = NOW() - t0; \
+} while (0)
+
+static size_t pick_size(void) {
+    int r = rand() % 100;
+    if (r < 70) return 1 + rand() % 128;
+    if (r < 95) return 1 + rand() % 4096;
+    return 1 + rand() % 65536;
+}
+
+static int compare(const void* a, const void* b) {
+    unsigned long long x = *(const unsigned long long*) a, y = *(const unsigned long long*) b;
+    return x < y ? -1 : x > y;
+}
+
+int main(int argc, char** argv) {
+    long ops = argc > 1 ? atol(argv[1]) : 1000000;
+    int max_live = argc > 2 ? atoi(argv[2]) : 20000;
+    int realloc_pct = argc > 3 ? atoi(argv[3]) : 0;
+
+    mem_init();
+    if (mm_init() == -1) {
+        fprintf(stderr, "mm_init failed\n");
+        return 1;
+    }
+
+    SAMPLES = malloc(ops*sizeof(unsigned long long));
+    void** live = calloc(max_live, sizeof(void*));
+    if (SAMPLES == NULL || live == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+    srand(1);
+
+    for (long k = 0; k < ops; k++) {
+        int i = rand() % max_live;
+        if (live[i] == NULL) {
+            size_t size = pick_size();
+            TIMED(live[i] = mm_malloc(size));
+            if (live[i] == NULL) {
+                fprintf(stderr, "mm_malloc(%zu) failed\n", size);
+                return 1;
+            }
+            memset(live[i], 1, size < 64 ? size : 64);
+        } else if (rand() % 100 < realloc_pct) {
+            size_t size = pick_size();
+            void* p;
+            TIMED(p = mm_realloc(live[i], size));
+            if (p == NULL) {
+                fprintf(stderr, "mm_realloc(%zu) failed\n", size);
+                return 1;
+            }
+            live[i] = p;
+        } else {
+            TIMED(mm_free(live[i]));
+            live[i] = NULL;
+        }
+    }
+
+    unsigned long long total = 0;
+    for (long i = 0; i < NUM_SAMPLES; i++) {
+        total += SAMPLES[i];
+    }
+    qsort(SAMPLES, NUM_SAMPLES, sizeof(unsigned long long), compare);
+    printf("%s per call: mean=%.0f p50=%llu p99=%llu p99.9=%llu p99.99=%llu max=%llu heap=%zuKB\n", UNIT,
+           (double) total/NUM_SAMPLES, SAMPLES[NUM_SAMPLES/2], SAMPLES[(long)(NUM_SAMPLES*0.99)],
+           SAMPLES[(long)(NUM_SAMPLES*0.999)], SAMPLES[(long)(NUM_SAMPLES*0.9999)], SAMPLES[NUM_SAMPLES - 1],
+           mem_heapsize() >> 10);
+    return 0;
+}
@@ -0,0 +1,187 @@
+/*
+ * bench_percpu.c - many threads, far more than there are cores, allocating small objects.
+ * Compare a -DTHREADS build against a -DTHREADS -DPERCPU one:
+ *
+ *   cc -O2 -pthread -DTHREADS -DPERCPU bench_percpu.c memlib.c -o bench_percpu
+ *   ./bench_percpu idle 512 200      threads run bursts, then stay alive and idle: throughput, and RSS held
+ *   ./bench_percpu stress 500 200000 threads check every object they free while a timer keeps interrupting them
+ */
+#include "memlib.h"
+#include "malloc.c"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#define BURST 64 /* objects a thread holds at once */
+
+static long ROUNDS; /* bursts per thread in idle mode, operations per thread in stress mode */
+static pthread_barrier_t DONE, EXIT; /* idle threads wait on these, alive, while RSS gets measured */
+static volatile long BAD; /* objects found overwritten in stress mode */
+static volatile long SIGNALS;
+
+/*
+ * idle_thread - ROUNDS bursts of BURST mallocs of 16 to 1016 bytes, then all of them freed.
+ * Then the thread waits, still alive, until main has measured RSS.
+ */
+static void* idle_thread(void* arg) {
+    unsigned int seed = (long) arg*7 + 1;
+    void* p[BURST];
+
+    for (long r = 0; r < ROUNDS; r++) {
+        for (int i = 0; i < BURST; i++) {
+            size_t size = 16 + rand_r(&seed) % 1001;
+            p[i] = mm_malloc(size);
+            if (p[i] == NULL) {
+                fprintf(stderr, "mm_malloc(%zu) failed\n", size);
+                exit(1);
+            }
+            memset(p[i], 1, 16);
+        }
+        for (int i = 0; i < BURST; i++) {
+            mm_free(p[i]);
+        }
+    }
+    pthread_barrier_wait(&DONE);
+    pthread_barrier_wait(&EXIT);
+    return NULL;
+}
+
+/*
+ * stress_thread - ROUNDS random mallocs/frees over BURST slots. Every object carries the thread id
+ * and a sequence number at the start and the end, checked when it's freed, so an object handed
+ * out twice or cached on the wrong CPU shows up as a mismatch.
+ */
+static void* stress_thread(void* arg) {
+    long tid = (long) arg;
+    unsigned int seed = tid*7 + 1;
+    long* live[BURST] = {NULL};
+    size_t size[BURST];
+
+    for (long k = 0; k < ROUNDS; k++) {
+        int i = rand_r(&seed) % BURST;
+        long* p = live[i];
+        if (p != NULL) {
+            if (p[0] != tid || ((unsigned char*) p)[size[i] - 1] != (unsigned char) p[1]) BAD++;
+            mm_free(p);
+            live[i] = NULL;
+        } else {
+            size[i] = 17 + rand_r(&seed) % 1000; //room for both tags without them overlapping
+            p = mm_malloc(size[i]);
+            if (p == NULL) {
+                fprintf(stderr, "mm_malloc(%zu) failed\n", size[i]);
+                exit(1);
+            }
+            p[0] = tid;
+            p[1] = k;
+            ((unsigned char*) p)[size[i] - 1] = (unsigned char) k;
+            live[i] = p;
+        }
+    }
+    for (int i = 0; i < BURST; i++) {
+        if (live[i] != NULL) mm_free(live[i]);
+    }
+    return NULL;
+}
+
+static void on_alarm(int sig) {
+    (void) sig;
+    SIGNALS++;
+}
+
+static long rss_kb(void) {
+    long pages = 0, resident = 0;
+    FILE* f = fopen("/proc/self/statm", "r");
+    if (f == NULL || fscanf(f, "%ld %ld", &pages, &resident) != 2) {
+        fprintf(stderr, "can't read /proc/self/statm\n");
+        exit(1);
+    }
+    fclose(f);
+    return resident*sysconf(_SC_PAGESIZE)/1024;
+}
+
+/*
+ * start_thread - pthread_create, giving up on the whole run if the thread can't be created. Idle mode
+ * would otherwise wait forever at a barrier for it
+ */
+static void start_thread(pthread_t* tid, pthread_attr_t* attr, void* (*run)(void*), long i) {
+    int err = pthread_create(tid, attr, run, (void*) i);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create failed after %ld threads: %s\n", i, strerror(err));
+        exit(1);
+    }
+}
+
+static double since(struct timespec* start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec)/1e9;
+}
+
+int main(int argc, char** argv) {
+    if (argc < 4) {
+        fprintf(stderr, "usage: %s idle|stress threads rounds\n", argv[0]);
+        return 1;
+    }
+    int idle = strcmp(argv[1], "idle") == 0;
+    int threads = atoi(argv[2]);
+    ROUNDS = atol(argv[3]);
+
+    mem_init();
+    if (mm_init() == -1) {
+        fprintf(stderr, "mm_init failed\n");
+        return 1;
+    }
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, 64*1024); //so thousands of threads fit, and their stacks don't swamp RSS
+    pthread_t* tids = malloc(threads*sizeof(pthread_t));
+    if (tids == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+    struct timespec start;
+
+    if (idle) {
+        pthread_barrier_init(&DONE, NULL, threads + 1);
+        pthread_barrier_init(&EXIT, NULL, threads + 1);
+        long base = rss_kb();
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long i = 0; i < threads; i++) {
+            start_thread(&tids[i], &attr, idle_thread, i);
+        }
+        pthread_barrier_wait(&DONE);
+        double secs = since(&start);
+        long held = rss_kb();
+        printf("threads=%d Mops/s=%.2f rss=%ldKB (+%ldKB over start)\n",
+               threads, 2.0*threads*ROUNDS*BURST/secs/1e6, held, held - base);
+        pthread_barrier_wait(&EXIT);
+    } else {
+        //a 20us timer, so threads keep getting interrupted in the middle of their fast paths
+        signal(SIGALRM, on_alarm);
+        struct itimerval timer = {{0, 20}, {0, 20}};
+        setitimer(ITIMER_REAL, &timer, NULL);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (long i = 0; i < threads; i++) {
+            start_thread(&tids[i], &attr, stress_thread, i);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+
+    if (!idle) {
+        printf("threads=%d Mops/s=%.2f bad=%ld signals=%ld", threads, threads*ROUNDS/since(&start)/1e6, BAD, SIGNALS);
+#ifdef PERCPU
+        printf(" rseq=%s", __rseq_size ? "yes" : "no");
+#endif
+        printf("\n");
+    }
+    return BAD != 0;
+}
@@ -0,0 +1,137 @@
+/*
+ * bench_remote.c - producer/consumer pairs, where every object is freed by a thread other than the
+ * one that allocated it. With arenas, that is a free into another thread's arena:
+ *
+ *   cc -O2 -pthread -DTHREADS -DNO_TCACHE bench_remote.c memlib.c -o bench_remote
+ *   ./bench_remote 8 200000 2000     up to 8 pairs, items per pair, biggest request over 16 bytes
+ *
+ * Pair counts double from 1 up to N, each on a fresh heap. The producer of a pair mallocs objects
+ * and hands them to its consumer through a ring; the consumer checks and frees them. Build with
+ * -DNO_TCACHE to see the remote frees themselves, since thread caches batch most of them away.
+ */
+#include "memlib.h"
+#include "malloc.c"
+#ifndef THREADS
+#error "bench_remote.c runs several threads at once, which needs -DTHREADS"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#define RING 1024 /* objects in flight between a producer and its consumer */
+
+/* What a producer hands to its consumer. Each end only writes its own index */
+typedef struct {
+    unsigned char* volatile slots[RING];
+    long head; /* written by the producer */
+    long tail; /* written by the consumer */
+    unsigned int seed;
+} ring_t;
+
+static long ITEMS; /* objects per pair */
+static int MAX_SIZE;
+static volatile long BAD; /* objects found overwritten */
+
+/*
+ * producer - ITEMS mallocs of 16 to 16 + MAX_SIZE bytes, each tagged with its size at the start
+ * and a marker at the end
+ */
+static void* producer(void* arg) {
+    ring_t* ring = arg;
+
+    for (long k = 0; k < ITEMS; k++) {
+        size_t size = 16 + rand_r(&ring->seed) % (MAX_SIZE + 1);
+        unsigned char* p = mm_malloc(size);
+        if (p == NULL) {
+            fprintf(stderr, "mm_malloc(%zu) failed\n", size);
+            exit(1);
+        }
+        *(size_t*) p = size;
+        p[size - 1] = 0x5a;
+
+        while (ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) >= RING) sched_yield();
+        ring->slots[ring->head % RING] = p;
+        __atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+/*
+ * consumer - takes ITEMS objects off the ring, checks their tags and frees them
+ */
+static void* consumer(void* arg) {
+    ring_t* ring = arg;
+
+    for (long k = 0; k < ITEMS; k++) {
+        while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail) sched_yield();
+        unsigned char* p = ring->slots[ring->tail % RING];
+        __atomic_store_n(&ring->tail, ring->tail + 1, __ATOMIC_RELEASE);
+
+        if (p[*(size_t*) p - 1] != 0x5a) BAD++;
+        mm_free(p);
+    }
+    return NULL;
+}
+
+static void start_thread(pthread_t* tid, void* (*run)(void*), ring_t* ring) {
+    int err = pthread_create(tid, NULL, run, ring);
+    if (err != 0) {
+        fprintf(stderr, "pthread_create failed: %s\n", strerror(err));
+        exit(1);
+    }
+}
+
+/*
+ * run - time pairs producer/consumer pairs on a fresh heap, in millions of items per second
+ */
+static double run(int pairs, ring_t* rings, pthread_t* tids) {
+    struct timespec start, end;
+
+    mem_reset_brk();
+    if (mm_init() == -1) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+    memset(rings, 0, pairs*sizeof(ring_t));
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < pairs; i++) {
+        rings[i].seed = i + 1;
+        start_thread(&tids[2*i], producer, &rings[i]);
+        start_thread(&tids[2*i + 1], consumer, &rings[i]);
+    }
+    for (int i = 0; i < 2*pairs; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+    return pairs*ITEMS/secs/1e6;
+}
+
+int main(int argc, char** argv) {
+    int max_pairs = argc > 1 ? atoi(argv[1]) : 8;
+    ITEMS = argc > 2 ? atol(argv[2]) : 200000;
+    MAX_SIZE = argc > 3 ? atoi(argv[3]) : 2000;
+    if (max_pairs < 1 || MAX_SIZE < 0) {
+        fprintf(stderr, "usage: %s max_pairs items_per_pair max_size\n", argv[0]);
+        return 1;
+    }
+
+    ring_t* rings = malloc(max_pairs*sizeof(ring_t));
+    pthread_t* tids = malloc(2*max_pairs*sizeof(pthread_t));
+    if (rings == NULL || tids == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+    mem_init();
+
+    for (int pairs = 1; ; pairs = pairs*2 < max_pairs ? pairs*2 : max_pairs) {
+        printf("pairs=%d Mitems/s=%.2f\n", pairs, run(pairs, rings, tids));
+        if (pairs == max_pairs) break;
+    }
+    if (BAD != 0) printf("bad=%ld\n", BAD);
+    return BAD != 0;
+}
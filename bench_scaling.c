@@ -0,0 +1,119 @@
+/*
+ * bench_scaling.c - throughput of small mallocs and frees from 1 thread up to N. Compare the
+ * thread caches against the lock-only baseline:
+ *
+ *   cc -O2 -pthread -DTHREADS bench_scaling.c memlib.c -o bench_scaling
+ *   cc -O2 -pthread -DTHREADS -DNO_TCACHE bench_scaling.c memlib.c -o bench_scaling_mutex
+ *   ./bench_scaling 16 400000 256     up to 16 threads, operations per thread, biggest request
+ *
+ * Thread counts double from 1 up to N, with N itself run last, each on a fresh heap. Every thread
+ * mallocs and frees at random over 1000 slots of its own, and checks on free that nothing else
+ * wrote over the object. On fewer cores than threads, what this shows is lock overhead and
+ * convoying rather than parallel speedup.
+ */
+#include "memlib.h"
+#include "malloc.c"
+#ifndef THREADS
+#error "bench_scaling.c runs several threads at once, which needs -DTHREADS"
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#define SLOTS 1000 /* objects a thread can have live at once */
+
+static long OPS; /* operations per thread */
+static int MAX_SIZE;
+static volatile long BAD; /* objects found overwritten */
+
+/*
+ * worker - OPS random mallocs/frees over SLOTS slots. Every object is filled with a byte of its
+ * slot and checked at both ends when it's freed.
+ */
+static void* worker(void* arg) {
+    unsigned int seed = (long) arg*7 + 1;
+    unsigned char* live[SLOTS] = {NULL};
+    size_t size[SLOTS];
+
+    for (long k = 0; k < OPS; k++) {
+        int i = rand_r(&seed) % SLOTS;
+        unsigned char* p = live[i];
+        if (p != NULL) {
+            if (p[0] != (unsigned char) i || p[size[i] - 1] != (unsigned char) i) BAD++;
+            mm_free(p);
+            live[i] = NULL;
+        } else {
+            size[i] = 1 + rand_r(&seed) % MAX_SIZE;
+            p = mm_malloc(size[i]);
+            if (p == NULL) {
+                fprintf(stderr, "mm_malloc(%zu) failed\n", size[i]);
+                exit(1);
+            }
+            memset(p, i, size[i]);
+            live[i] = p;
+        }
+    }
+    for (int i = 0; i < SLOTS; i++) {
+        if (live[i] != NULL) mm_free(live[i]);
+    }
+    return NULL;
+}
+
+/*
+ * run - time threads workers on a fresh heap, in Mops/s
+ */
+static double run(int threads, pthread_t* tids) {
+    struct timespec start, end;
+
+    mem_reset_brk();
+    if (mm_init() == -1) {
+        fprintf(stderr, "mm_init failed\n");
+        exit(1);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (long i = 0; i < threads; i++) {
+        int err = pthread_create(&tids[i], NULL, worker, (void*) i);
+        if (err != 0) {
+            fprintf(stderr, "pthread_create failed after %ld threads: %s\n", i, strerror(err));
+            exit(1);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        pthread_join(tids[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec)/1e9;
+    return threads*OPS/secs/1e6;
+}
+
+int main(int argc, char** argv) {
+    int max_threads = argc > 1 ? atoi(argv[1]) : 16;
+    OPS = argc > 2 ? atol(argv[2]) : 400000;
+    MAX_SIZE = argc > 3 ? atoi(argv[3]) : 256;
+    if (max_threads < 1 || MAX_SIZE < 1) {
+        fprintf(stderr, "usage: %s max_threads ops_per_thread max_size\n", argv[0]);
+        return 1;
+    }
+
+    pthread_t* tids = malloc(max_threads*sizeof(pthread_t));
+    if (tids == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        return 1;
+    }
+    mem_init();
+
+#ifdef NO_TCACHE
+    printf("lock only\n");
+#else
+    printf("thread caches\n");
+#endif
+    for (int threads = 1; ; threads = threads*2 < max_threads ? threads*2 : max_threads) {
+        printf("threads=%d Mops/s=%.2f\n", threads, run(threads, tids));
+        if (threads == max_threads) break;
+    }
+    if (BAD != 0) printf("bad=%ld\n", BAD);
+    return BAD != 0;
+}
@@ -1,3 +1,45 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE /* for mremap */
+#endif
+#include <sys/mman.h>
+#include <string.h> /* for memcpy, memmove */
+#include <stdint.h> /* for SIZE_MAX */
+#include <stdio.h> /* for what mm_checkheap reports */
+#ifdef THREADS
+#include <pthread.h>
+#endif
+#ifdef PURGE_DECAY
+#ifndef THREADS
+#error "-DPURGE_DECAY needs -DTHREADS, the purging thread relies on the arena locks"
+#endif
+#include <time.h>
+#endif
+#ifdef PERCPU
+#if !defined(THREADS) || defined(NO_TCACHE)
+#error "-DPERCPU needs -DTHREADS with the thread caches, which are what threads without rseq fall back to"
+#endif
+#ifndef __x86_64__
+#error "-DPERCPU has its restartable sequences written for x86-64 only"
+#endif
+#include <sys/rseq.h>
+#include <unistd.h> /* for sysconf */
+#endif
+#if defined(ADDRESS_ORDER) && defined(TLSF)
+#error "-DADDRESS_ORDER only applies to the lists of the default engine"
+#endif
+#if defined(NEXT_FIT) && defined(TLSF)
+#error "-DNEXT_FIT only applies to the lists of the default engine, TLSF never searches a list"
+#endif
+#if defined(BUDDY) && (defined(TLSF) || defined(ADDRESS_ORDER) || defined(NEXT_FIT))
+#error "-DBUDDY is an engine of its own, it can't be combined with -DTLSF, -DADDRESS_ORDER or -DNEXT_FIT"
+#endif
+#if defined(BUDDY) && (defined(DEFER_COALESCE) || defined(PURGE_DECAY))
+#error "-DBUDDY merges on every free and purges as it merges, -DDEFER_COALESCE and -DPURGE_DECAY don't apply"
+#endif
+#if defined(SIDE_LISTS) && (defined(TLSF) || defined(BUDDY) || defined(ADDRESS_ORDER) || defined(NEXT_FIT))
+#error "-DSIDE_LISTS only applies to the unordered lists of the default engine"
+#endif
+
 /* Basic constants and macros.
  * Since we have to perform a lot of pointer manipulation, it's better to
  * abstract away some of the common commands to both make the code readable and
@@ -7,6 +49,123 @@
 #define WSIZE 4 /* Word size. Same as that of the header, footer, fwrd, bwrd pointers */
 #define DSIZE 8 /* Double size. For convenience sake, instead of doing WSIZE*2 every time */
 #define DEFAULT_CHUNKSIZE 4096 /* Default chunksize to increase the heap pointer by when we need more memory from the heap 1 */
+#define GROW_MAX (1 << 20) /* Extensions double from DEFAULT_CHUNKSIZE up to this, see grow_size */
+#define GROW_SHARE 8 /* ...but only while they are less than 1/GROW_SHARE of the heap, to bound the overshoot */
+#define MIN_BLOCK_SIZE (2*DSIZE) /* Smallest possible block: a free block still needs header + next + prev + footer */
+#define OS_PAGE_SIZE 4096 /* Granularity of what we get from/give back to the OS with mmap */
+#define MMAP_THRESHOLD (128*1024) /* Requests at least this big get a mapping of their own instead of a heap block */
+#define MAPPED_HDR_SIZE (2*DSIZE) /* Room in front of a mapped block's payload: the mapping length, then the header */
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (256*1024) /* A free block this big at the end of the heap gets trimmed on free. Can be set with -DTRIM_THRESHOLD=... */
+#endif
+#define TRIM_PAD (64*1024) /* What trimming on free leaves at the end of the heap, so the next growth needn't come straight back */
+
+/* With -DHUGE_PAGES the heap is backed in whole HUGE_PAGE_SIZE segments, each aligned to that size,
+ * and asks for transparent huge pages on them, so a big heap takes far fewer TLB misses. Purging and
+ * trimming then only drop whole huge pages, since dropping part of one splits it back into small ones.
+ */
+#define HUGE_PAGE_SIZE (2*1024*1024)
+#ifdef HUGE_PAGES
+#define PURGE_PAGE_SIZE HUGE_PAGE_SIZE /* Granularity of what purging and trimming give back */
+#else
+#define PURGE_PAGE_SIZE OS_PAGE_SIZE
+#endif
+#define PURGE_THRESHOLD (2*PURGE_PAGE_SIZE) /* Free blocks at least this big get their whole interior pages dropped */
+
+/* With -DPURGE_DECAY, big free blocks aren't purged as they are freed. A background thread wakes up
+ * every DECAY_TIME_MS/DECAY_EPOCHS milliseconds and purges the oldest ones until what's left is
+ * within a target that decays linearly to 0 over DECAY_TIME_MS, the way jemalloc does it.
+ */
+#define DECAY_TIME_MS 10000 /* how long freed memory may stay dirty, at most */
+#define DECAY_EPOCHS 100 /* steps the decay curve is split into */
+#define NUM_CLASSES 8 /* Number of segregated free lists in the default engine. The last one is a tree, see TREE_CLASS */
+
+/* Parameters of the TLSF (Two-Level Segregated Fit) engine, picked by building with -DTLSF.
+ * A free block is first classed by the position of its most significant bit (first level), then
+ * that power-of-two range is split linearly into SL_COUNT second-level classes.
+ */
+#define SL_BITS 3 /* log2 of the number of second-level classes per first-level class */
+#define SL_COUNT (1 << SL_BITS)
+#define SMALL_BLOCK_SIZE (SL_COUNT*DSIZE) /* blocks below this all go to first-level class 0, in exact 8 byte steps */
+#define FL_COUNT 28 /* enough first-level classes for any size a 4 byte header can hold */
+
+/* Parameters of the binary buddy engine, picked by building with -DBUDDY. Every block is a power of
+ * two in size, header included, and sits at a multiple of its size from BUDDY_BASE, so its buddy is
+ * found by flipping one bit of its offset. The heap grows in whole blocks of the top order.
+ */
+#define BUDDY_MIN_ORDER 4 /* log2 of MIN_BLOCK_SIZE */
+#define BUDDY_ORDERS 16 /* 16B to 512KB */
+#define BUDDY_MAX_SIZE (1 << (BUDDY_MIN_ORDER + BUDDY_ORDERS - 1)) /* 512KB, enough for anything below MMAP_THRESHOLD */
+
+/* Small requests don't get boundary-tagged blocks at all. They come from slab pages: page-aligned
+ * SLAB_PAGE_SIZE blocks carved out of the heap, each holding objects of a single size class
+ * packed back to back, with a small descriptor at the start of the page. Masking an object's
+ * address gives its page, so freeing it needs no header.
+ * Up to SLAB_FINE_MAX there is a class per 8 bytes. Above that, each class is the biggest size that
+ * still fits k objects in a page, for k = SLAB_MOST down to 4, so no page wastes more than 8 bytes
+ * per object.
+ */
+#define SLAB_FINE_MAX 256
+#define SLAB_FINE_CLASSES (SLAB_FINE_MAX/DSIZE)
+#define SLAB_MOST 15 /* objects per page of the first class above SLAB_FINE_MAX */
+#define SLAB_CLASSES (SLAB_FINE_CLASSES + SLAB_MOST - 3) /* even, to keep HEAD_WORDS odd */
+#define SLAB_MAX_SIZE 1016 /* biggest request served from a slab: SLAB_CLASS_SIZE(SLAB_CLASSES - 1) */
+#define SLAB_PAGE_SIZE 4096
+#define SLAB_PAGE_SHIFT 12 /* log2 of SLAB_PAGE_SIZE */
+#define SLAB_HDR_SIZE (6*WSIZE) /* descriptor at the start of each slab page, see SLAB_SIZEP */
+#define SLAB_END (SLAB_PAGE_SIZE - WSIZE) /* the last word of a slab page is the next block's header */
+#define SLAB_ROOM (SLAB_END - SLAB_HDR_SIZE) /* room for objects in a page */
+#define SLAB_MAP_WORDS ((1 << (32 - SLAB_PAGE_SHIFT))/32) /* one bit per page of a heap of up to 4GB, see MAX_HEAP_SPAN */
+
+/* Freed heap blocks of the sizes just above the slab range don't get coalesced right away. They go
+ * onto a LIFO fast bin of their exact size, still marked as allocated, and the next request of that
+ * size takes them straight back. consolidate_bins frees them all properly once the free lists
+ * can't satisfy a request.
+ *
+ * Building with -DDEFER_COALESCE defers the rest of the frees too. Every other heap block goes onto
+ * one unsorted bin, also still marked allocated, and the whole bin is coalesced and sorted into the
+ * free lists in one pass, either when find_fit misses or when it holds more than UNSORTED_MAX bytes.
+ *
+ * Emptying the bins doesn't purge what comes out of them. Held-back frees merge into far bigger
+ * blocks than they would one at a time, most of which get split up again right away, and purging
+ * those would just mean faulting the pages back in. mm_trim purges them, and so does -DPURGE_DECAY.
+ */
+#define FAST_MIN_SIZE 1024 /* adjust_size(SLAB_MAX_SIZE + 1), the smallest block a heap_malloc asks for */
+#ifdef BUDDY
+#define FAST_BINS 0 /* splitting and merging buddies is cheap enough already */
+#else
+#define FAST_BINS 96 /* one bin per 8 bytes of block size, up to FAST_MAX_SIZE */
+#endif
+#define FAST_MAX_SIZE (FAST_MIN_SIZE + (FAST_BINS - 1)*DSIZE)
+#ifndef UNSORTED_MAX
+#define UNSORTED_MAX (256*1024)
+#endif
+
+/* Thread support, picked by building with -DTHREADS. The heap is shared behind a single lock, and
+ * each thread keeps a cache of small objects in front of it so most calls never take that lock.
+ * Building with -DNO_TCACHE as well leaves just the lock, which is handy as a baseline.
+ */
+#if defined(THREADS) && !defined(NO_TCACHE)
+#define TCACHE
+#endif
+#define TCACHE_BINS SLAB_CLASSES /* one bin per slab class */
+#define TCACHE_LIMIT 64 /* objects a bin may hold before part of it is flushed back to the heap */
+#define TCACHE_BATCH 32 /* objects moved per refill/flush, under a single lock acquisition */
+
+/* With -DPERCPU as well, the small object caches belong to CPUs instead of threads, so what they
+ * hold is bounded by the number of CPUs however many threads there are. A thread pushes and pops
+ * objects on the cache of the CPU it runs on inside a restartable sequence (rseq), which the kernel
+ * restarts if the thread gets preempted or migrated halfway, so the fast paths need no atomics.
+ * Threads glibc couldn't register with rseq keep using their thread cache.
+ */
+#define PCPU_LIMIT TCACHE_LIMIT /* objects a per-CPU bin may hold */
+
+/* With -DTHREADS the heap is also split into NUM_ARENAS independent arenas, each with its own lists
+ * and lock, so threads spread over them instead of all waiting on one lock. Arena 0 is the usual
+ * mem_sbrk heap; the others each get ARENA_SIZE bytes of address space to grow in.
+ */
+#define NUM_ARENAS 4
+#define ARENA_SIZE (1ul << 28) /* 256MB. Must stay below 4GB so link offsets still fit in a word */
 
 #define MAX(x, y) ((x) > (y) ? (x) : (y)) /* Simple Max command */
 
@@ -15,8 +174,11 @@
  * on 8-byte boundary, every block's size is a multiple of 8. In binary, this means the 3 least
  * significant bits will always be 0. We can use this to set the LSB to either 0 or 1 to 
  * store whether a block is allocated or free.
+ *
+ * The bit next to it stores whether the previous block is allocated. Only free blocks have a
+ * footer, so this bit is how we know whether there is a footer right before the header at all.
  */
-#define PACK(size, alloc) ((size) | (alloc)) //1 is allocated. 0 is free.
+#define PACK(size, prev_alloc, alloc) ((size) | ((prev_alloc) << 1) | (alloc)) //1 is allocated. 0 is free.
 
 /* These 2 macros help us read or write a value at a certain address p.
  * 
@@ -35,6 +197,38 @@
 /* Given a metadata pointer (mp), or the pointer to the header/footer, return the size or the alloc info */
 #define GET_SIZE(mp) (READ(mp) & ~0x7) /* 0x7 = 0b111 */
 #define GET_ALLOC(mp) (READ(mp) & 0x1)
+#define GET_PREV_ALLOC(mp) ((READ(mp) >> 1) & 0x1)
+
+/* Round an address down/up to a page boundary */
+#define PAGE_DOWN(p) ((void*)((unsigned long)(p) & ~(unsigned long)(OS_PAGE_SIZE - 1)))
+#define PAGE_UP(p) PAGE_DOWN((void*)(p) + OS_PAGE_SIZE - 1)
+
+/* The same for the pages purging works in, and for huge page segments */
+#define PURGE_DOWN(p) ((void*)((unsigned long)(p) & ~(unsigned long)(PURGE_PAGE_SIZE - 1)))
+#define PURGE_UP(p) PURGE_DOWN((void*)(p) + PURGE_PAGE_SIZE - 1)
+#define HUGE_UP(p) ((void*)(((unsigned long)(p) + HUGE_PAGE_SIZE - 1) & ~(unsigned long)(HUGE_PAGE_SIZE - 1)))
+
+/* The third bit is only ever set in the header of a block that lives in a mapping of its own, outside
+ * the heap. Heap blocks have no use for it, and slab objects have no header at all, so check for
+ * those first.
+ */
+#define MAPPED 0x4
+#define IS_MAPPED(mp) (READ(mp) & MAPPED)
+
+/* In the header of a free block the same bit means the block has been purged: every whole page
+ * inside it, apart from the ones holding its header, links and footer, was handed back with
+ * madvise and reads as zero until written. Writing the header with PACK clears it, which only
+ * ever makes us purge a block again for nothing.
+ */
+#define PURGED 0x4
+#define IS_PURGED(mp) (READ(mp) & PURGED)
+
+/* Length of the mapping holding a mapped block, kept in front of its header */
+#define MAPPED_LENP(bp) ((size_t*)((void*)(bp) - MAPPED_HDR_SIZE))
+
+/* Flip the prev-alloc bit of a header, for when the block before it changes state */
+#define SET_PREV_ALLOC(mp) WRITE(mp, READ(mp) | 0x2)
+#define CLEAR_PREV_ALLOC(mp) WRITE(mp, READ(mp) & ~0x2)
 
 /* Given a block pointer (bp), or the pointer to the first block right after the header of a chunk,
  * return the next/prev pointers
@@ -42,45 +236,588 @@
 #define NEXTP(bp) ((void*)(bp))
 #define PREVP(bp) ((void*)(bp) + WSIZE)
 
+/* Blocks in the size tree of the default engine also have a left and a right child, after the
+ * dirty list links of -DPURGE_DECAY. Purging has to leave all of these words alone.
+ */
+#define TREE_LEFTP(bp) ((void*)(bp) + 4*WSIZE)
+#define TREE_RIGHTP(bp) ((void*)(bp) + 5*WSIZE)
+#define FREE_LINKS_SIZE (6*WSIZE)
+
+/* With -DSIDE_LISTS, a block on one of the lists only holds its index in the side array of its class,
+ * in its NEXTP word, or SIDE_UNLISTED if the array couldn't grow to take it
+ */
+#define SIDE_INDEXP(bp) NEXTP(bp)
+#define SIDE_UNLISTED (~0u)
+#define SIDE_MIN_ENTRIES (OS_PAGE_SIZE/sizeof(side_entry_t)) /* a side array starts out one page big */
+
+/* With -DADDRESS_ORDER, blocks in the lists of the default engine are also nodes of an address tree,
+ * with their children in the two words after the links. Those blocks are never big enough to be on
+ * the dirty list, and never smaller than 24 bytes, so the words are free.
+ */
+#define ADDR_LEFTP(bp) ((void*)(bp) + 2*WSIZE)
+#define ADDR_RIGHTP(bp) ((void*)(bp) + 3*WSIZE)
+
+/* The splay code serves both kinds of tree, ordered by block size or by address */
+#define LEFTP(bp, by_addr) ((by_addr) ? ADDR_LEFTP(bp) : TREE_LEFTP(bp))
+#define RIGHTP(bp, by_addr) ((by_addr) ? ADDR_RIGHTP(bp) : TREE_RIGHTP(bp))
+#define KEY(bp, by_addr) ((by_addr) ? (size_t)(bp) : GET_SIZE(HDRP(bp)))
+
+/* Free list links (next/prev pointers and the roots) are not stored as raw pointers, since those
+ * don't fit in a word on a 64-bit machine once the heap sits above 4GB. Instead we store the
+ * offset of the block from the start of the heap. Offset 0 is the first root, which is never a
+ * block, so it doubles as NULL.
+ * An offset only reaches 4GB, so no heap may grow past MAX_HEAP_SPAN bytes from the page it starts
+ * in. heap_sbrk refuses to; the slab map is sized for that much too.
+ */
+#define MAX_HEAP_SPAN (1ul << 32)
+#define ENCODE(bp) ((bp) ? (unsigned int)((void*)(bp) - FREE_LISTS) : 0)
+#define DECODE(off) ((off) ? FREE_LISTS + (off) : NULL)
+
+/* Read/write a link word (NEXTP, PREVP or a root) as a pointer */
+#define GET_LINK(p) DECODE(READ(p))
+#define SET_LINK(p, bp) WRITE(p, ENCODE(bp))
+
 /* Given bp, calculate the pointer to the header/footer of the chunk */
 #define HDRP(bp) ((void*)(bp) - WSIZE)
-#define FTRP(bp) ((void*)(bp) + GET_SIZE(HDRP(bp)) - DSIZE) //-2*WSIZE to skip past the header of the next chunk too to get to the footer
+#define FTRP(bp) ((void*)(bp) + GET_SIZE(HDRP(bp)) - DSIZE) //-2*WSIZE to skip past the header of the next chunk too to get to the footer. Only valid for free blocks
 
 /* Given bp, compute bp of the contiguous next and prev block */
 #define NEXT_BLKP(bp) ((void*)(bp) + GET_SIZE((void*)bp - WSIZE))
-#define PREV_BLKP(bp) ((void*)(bp) - GET_SIZE((void*)bp - DSIZE)) //getting size of prev block here to know how much to jump to reach previous block
+#define PREV_BLKP(bp) ((void*)(bp) - GET_SIZE((void*)bp - DSIZE)) //getting size of prev block here to know how much to jump to reach previous block. Only valid if the prev block is free
+
+/* Given a size class index, return the address of the root word of that class's free list.
+ * The roots live contiguously at the very start of the heap, so this is just array indexing.
+ */
+#define ROOTP(class) (FREE_LISTS + (class)*WSIZE)
+
+#ifdef TLSF
+/* Occupancy bitmaps sit right after the roots: first a word with bit fl set if any class of first
+ * level fl is non-empty, then one word per first level with bit sl set if class (fl, sl) is non-empty.
+ * List (fl, sl) is root number fl*SL_COUNT + sl.
+ */
+#define NUM_LISTS (FL_COUNT*SL_COUNT)
+#define FL_BITMAPP (FREE_LISTS + NUM_LISTS*WSIZE)
+#define SL_BITMAPP(fl) (FL_BITMAPP + (1 + (fl))*WSIZE)
+#define LIST_WORDS (NUM_LISTS + 1 + FL_COUNT)
+#else
+/* Address of the occupancy bitmap word, which sits right after the roots.
+ * Bit i is set exactly when the list of class i is non-empty, so NUM_CLASSES has to fit in a word.
+ * The buddy engine has one class per order instead.
+ */
+#ifdef BUDDY
+#define NUM_LISTS BUDDY_ORDERS
+#else
+#define NUM_LISTS NUM_CLASSES
+#endif
+#define BITMAPP (FREE_LISTS + NUM_LISTS*WSIZE)
+#define LIST_WORDS (NUM_LISTS + 1)
+#endif
+
+/* After the free lists come the roots of the slab page lists, one per slab class. Each one links
+ * the pages of its class that still have room, through the page descriptors.
+ */
+#define SLAB_ROOTP(class) (FREE_LISTS + (LIST_WORDS + (class))*WSIZE)
+
+#ifdef PURGE_DECAY
+/* Then the two ends of the dirty list, which holds every free block of PURGE_THRESHOLD or more
+ * that isn't purged yet, newest first, so the oldest is at the tail. Blocks that big have room
+ * for two more links after the free list ones.
+ */
+#define DIRTY_HEADP (FREE_LISTS + (LIST_WORDS + SLAB_CLASSES)*WSIZE)
+#define DIRTY_TAILP (DIRTY_HEADP + WSIZE)
+#define DIRTY_NEXTP(bp) ((void*)(bp) + 2*WSIZE) //towards older blocks
+#define DIRTY_PREVP(bp) ((void*)(bp) + 3*WSIZE)
+#define IS_DIRTY(mp) (GET_SIZE(mp) >= PURGE_THRESHOLD && !IS_PURGED(mp))
+#define DIRTY_WORDS 2
+#else
+#define DIRTY_WORDS 0
+#endif
+
+/* Then the roots of the fast bins. Each bin is singly linked through NEXTP */
+#define FAST_ROOTP(size) (FREE_LISTS + (LIST_WORDS + SLAB_CLASSES + DIRTY_WORDS + ((size) - FAST_MIN_SIZE)/DSIZE)*WSIZE)
+#define IS_FAST_SIZE(size) ((size) >= FAST_MIN_SIZE && (size) <= FAST_MAX_SIZE)
+
+/* And the root of the unsorted bin, linked the same way */
+#ifdef DEFER_COALESCE
+#define UNSORTED_ROOTP (FAST_ROOTP(FAST_MIN_SIZE) + FAST_BINS*WSIZE)
+#define UNSORTED_WORDS 2 //the root, and a spare word to keep HEAD_WORDS odd
+#else
+#define UNSORTED_WORDS 0
+#endif
+
+/* And the roots of the address trees of classes 1 to TREE_CLASS - 1 */
+#ifdef ADDRESS_ORDER
+#define ADDR_ROOTP(class) (FREE_LISTS + (LIST_WORDS + SLAB_CLASSES + DIRTY_WORDS + FAST_BINS + UNSORTED_WORDS + (class) - 1)*WSIZE)
+#define ADDR_WORDS (NUM_CLASSES - 2)
+#else
+#define ADDR_WORDS 0
+#endif
+
+/* HEAD_WORDS counts the roots and bitmaps in front of the prologue. It has to be odd, so that the
+ * prologue header ends up 4 bytes past an 8-byte boundary and every payload after it is aligned.
+ */
+#define HEAD_WORDS (LIST_WORDS + SLAB_CLASSES + DIRTY_WORDS + FAST_BINS + UNSORTED_WORDS + ADDR_WORDS)
+_Static_assert(HEAD_WORDS % 2 == 1, "the head words have to leave the prologue header 4 bytes past an 8-byte boundary");
+
+#ifdef BUDDY
+/* With -DBUDDY there is no prologue. Blocks start right after the head words instead, at the first
+ * address 4 bytes short of a page boundary, so the payload of any block of a page or more is page-aligned
+ */
+#define BUDDY_BASE (PAGE_UP(FREE_LISTS + (HEAD_WORDS + 1)*WSIZE) - WSIZE)
+
+/* Given bp of a block of the given size, compute bp of its buddy: flip the size bit of its offset */
+#define BUDDY_BLKP(bp, size) (BUDDY_BASE + (((unsigned long)(HDRP(bp) - BUDDY_BASE)) ^ (size)) + WSIZE)
+
+/* Round an adjusted size up to the size of the block it gets */
+#define BUDDY_SIZE(asize) ((size_t)MIN_BLOCK_SIZE << get_class(asize))
+#endif
+
+/* Given any pointer into a slab page, return the page (the page-aligned address below it) */
+#define SLAB_PAGEP(bp) ((void*)((unsigned long)(bp) & ~(unsigned long)(SLAB_PAGE_SIZE - 1)))
+
+/* Given a slab page, return the words of its descriptor: the object size, how many objects are
+ * handed out, the page offset of the first free object (0 if none, each free object holds the
+ * offset of the next), the page offset of the first never used object, and the next/prev links
+ * of the page's slab list
+ */
+#define SLAB_SIZEP(page) ((void*)(page))
+#define SLAB_USEDP(page) ((void*)(page) + WSIZE)
+#define SLAB_FREEP(page) ((void*)(page) + 2*WSIZE)
+#define SLAB_BUMPP(page) ((void*)(page) + 3*WSIZE)
+#define SLAB_NEXTP(page) ((void*)(page) + 4*WSIZE)
+#define SLAB_PREVP(page) ((void*)(page) + 5*WSIZE)
+
+/* Map a small request size (1 to SLAB_MAX_SIZE) to its slab class, and back. Above SLAB_FINE_MAX,
+ * the class is found from how many objects of the size, rounded up to 8, fit in a page
+ */
+#define SLAB_CLASS(size) ((size) <= SLAB_FINE_MAX ? ((size) - 1)/DSIZE \
+                          : SLAB_FINE_CLASSES + SLAB_MOST - SLAB_ROOM/(((size) + DSIZE - 1) & ~(DSIZE - 1)))
+#define SLAB_CLASS_SIZE(class) ((class) < SLAB_FINE_CLASSES ? ((class) + 1)*DSIZE \
+                                : (SLAB_ROOM/(SLAB_FINE_CLASSES + SLAB_MOST - (class))) & ~(DSIZE - 1))
 
 /* forward declaration of helper functions */
 static void* extend_heap(size_t words);
+static void* malloc_block(size_t asize);
+static void free_block(void* bp);
+static void coalesce_block(void* bp, int purge);
+static void* realloc_block(void* ptr, size_t asize);
 static void* find_fit(size_t asize);
 static void* handle_free(void* bp);
 static void handle_malloc(void* bp, size_t asize);
-static void add_free(void* bp, void** free_list_root);
-static void fb_patching(void* bp, void** free_list_root);
+static void shrink_block(void* bp, size_t asize);
+static size_t adjust_size(size_t size);
+static void add_free(void* bp);
+static void fb_patching(void* bp);
+static int get_class(size_t size);
+static void set_class_bit(int class);
+static void clear_class_bit(int class);
+static void* malloc_aligned_block(size_t asize, size_t align);
+static void* slab_malloc(int class);
+static void slab_free(void* bp);
+static int slab_object(void* bp);
+static void release_block(void* bp);
+static void* mmap_block(size_t size);
+static void munmap_block(void* bp);
+static void* mremap_block(void* bp, size_t size);
+static int trim_heap(size_t pad);
+static size_t grow_size(size_t asize);
+static int consolidate_bins(int purge);
+static void purge_pages(void* bp, void* lo, void* hi);
+
+#ifdef THREADS
+#define THREAD_LOCAL __thread
+#else
+#define THREAD_LOCAL
+#endif
 
-/* Explicit free list root is a static pointer */
-static void* FREE_LIST_ROOT = NULL;
+/* Pointer to the array of segregated free list roots at the start of the heap.
+ * In the default engine, class i holds free blocks of size (2^(i+3), 2^(i+4)], except the
+ * last class which holds everything bigger than that.
+ * With arenas, this is the heap of whichever arena the calling thread has locked at the moment.
+ */
+static THREAD_LOCAL void* FREE_LISTS = NULL;
+
+static int init_heap(void);
+static void* heap_sbrk(size_t incr);
+static void* arena_malloc(size_t size);
+static void* heap_malloc(size_t size);
+
+#ifdef THREADS
+/* An arena is a heap of its own: roots, bitmaps, prologue/epilogue and blocks, plus its lock.
+ * Threads that free a block of an arena other than their own don't take its lock. They push the
+ * block onto the arena's remote free stack instead, which is lock-free, and whoever next takes
+ * the lock to allocate frees the whole stack in one go.
+ */
+typedef struct {
+    void* heap; /* what FREE_LISTS is while working on this arena */
+    void* brk; /* current end of the arena */
+    void* top; /* end of the memory backing it: what mem_sbrk gave arena 0, the end of the reservation for the others */
+    size_t grow; /* how much the next extension asks for at least */
+    void* remote_frees; /* top of the remote free stack, linked through REMOTE_NEXT */
+    pthread_mutex_t lock;
+} arena_t;
+
+static arena_t ARENAS[NUM_ARENAS];
+static void* ARENA_REGION = NULL; //one reservation holding arena i at ARENA_REGION + (i - 1)*ARENA_SIZE
+static THREAD_LOCAL arena_t* CUR_ARENA = NULL; //arena the calling thread has locked
+static THREAD_LOCAL arena_t* MY_ARENA = NULL; //arena the calling thread allocates from
+static int NEXT_ARENA = 0; //for round-robin assignment of threads to arenas
+
+static arena_t* my_arena(void);
+static arena_t* owner_arena(void* bp);
+static void lock_arena(arena_t* arena);
+static void remote_free(arena_t* arena, void* bp);
+static void drain_remote_frees(void);
+
+/* Blocks on a remote free stack still look allocated; the link is a native pointer in the payload */
+#define REMOTE_NEXT(bp) (*(void**)(bp))
+
+#define LOCK_ARENA(arena) lock_arena(arena)
+#define UNLOCK_ARENA() pthread_mutex_unlock(&CUR_ARENA->lock)
+#define NUM_HEAPS NUM_ARENAS
+#define HEAP_INDEX() (CUR_ARENA - ARENAS) //which heap FREE_LISTS is at the moment
+#define HEAP_BRK (CUR_ARENA->brk)
+#define HEAP_TOP (CUR_ARENA->top)
+#define HEAP_GROW (CUR_ARENA->grow)
+#else
+#define LOCK_ARENA(arena)
+#define UNLOCK_ARENA()
+#define NUM_HEAPS 1
+#define HEAP_INDEX() 0
+
+/* End of the heap, and end of the memory mem_sbrk has given us. They only differ after a trim:
+ * the pages in between were handed back to the OS, and the heap grows into them again first.
+ */
+static void* HEAP_BRK = NULL;
+static void* HEAP_TOP = NULL;
+static size_t HEAP_GROW = DEFAULT_CHUNKSIZE; //how much the next extension asks for at least
+#endif
+
+/* Which pages of each heap are slab pages, one bit per page counting from the page the heap starts in.
+ * This is what tells a slab object apart from a boundary-tagged block, since a slab object has no
+ * header to look at. SLAB_MAP_TOP is one past the highest page ever marked, so a new heap only
+ * has to clear that much.
+ */
+static unsigned int SLAB_MAP[NUM_HEAPS][SLAB_MAP_WORDS];
+static unsigned int SLAB_MAP_TOP[NUM_HEAPS];
+
+/* How many blocks sit in the fast bins of each heap, so that consolidating an empty set is free */
+static unsigned int FAST_BLOCKS[NUM_HEAPS];
+#ifdef DEFER_COALESCE
+/* How many bytes sit in the unsorted bin of each heap */
+static size_t UNSORTED_BYTES[NUM_HEAPS];
+#endif
+#ifdef NEXT_FIT
+/* With -DNEXT_FIT, where the last search of each list stopped, so the next one carries on from there.
+ * NULL means the head. fb_patching moves a rover on to the next block when it removes the block under it.
+ */
+static void* ROVER[NUM_HEAPS][NUM_CLASSES];
+#endif
+#ifdef SIDE_LISTS
+/* With -DSIDE_LISTS, the lists below the size tree aren't linked through the blocks. Each one is a
+ * dense array of (size, offset) pairs in a mapping of its own, newest last, so find_fit scans
+ * contiguous memory that the hardware prefetches, and never touches a block until it has found one
+ * that fits. Removing a block moves the last entry into its slot. The arrays are kept across mm_init.
+ */
+typedef struct {
+    unsigned int size;
+    unsigned int off; /* ENCODE(bp) */
+} side_entry_t;
+
+static side_entry_t* SIDE_LIST[NUM_HEAPS][NUM_CLASSES];
+static unsigned int SIDE_COUNT[NUM_HEAPS][NUM_CLASSES];
+static unsigned int SIDE_CAP[NUM_HEAPS][NUM_CLASSES];
+
+static void side_push(void* bp, int class);
+static void side_remove(void* bp, int class);
+#endif
+
+/* How many madvise calls purging has made on each heap, and how many bytes they covered */
+static unsigned long PURGE_COUNT[NUM_HEAPS];
+static unsigned long PURGE_BYTES[NUM_HEAPS];
+
+#ifdef PURGE_DECAY
+/* Decay state of each heap: the bytes on its dirty list, what that was at the end of the last
+ * epoch, and how many bytes got dirtied in each of the last DECAY_EPOCHS epochs, newest first
+ */
+static size_t DIRTY_BYTES[NUM_HEAPS];
+static size_t DECAY_LAST[NUM_HEAPS];
+static size_t DECAY_NEW[NUM_HEAPS][DECAY_EPOCHS];
+static pthread_once_t DECAY_ONCE = PTHREAD_ONCE_INIT;
+
+static void dirty_link(void* bp);
+static void dirty_unlink(void* bp);
+static void decay_start(void);
+#endif
+
+#ifdef TCACHE
+/* Per-thread cache of small objects, one LIFO bin per slab class.
+ * A cached object still counts as handed out as far as its slab page is concerned, and the bins
+ * are singly linked through a native pointer in the object (every class has room for one).
+ * The cache only belongs to the heap of the generation it was filled in, since mm_init throws
+ * the whole heap away.
+ */
+static __thread void* TCACHE_BIN[TCACHE_BINS];
+static __thread int TCACHE_COUNT[TCACHE_BINS];
+static __thread unsigned int TCACHE_GEN = 0;
+static unsigned int HEAP_GEN = 0; //bumped by every mm_init
+static pthread_key_t TCACHE_KEY; //only used to flush the cache back when its thread exits
+static pthread_once_t TCACHE_ONCE = PTHREAD_ONCE_INIT;
+
+#define TCACHE_NEXT(bp) (*(void**)(bp))
+
+static void* tcache_malloc(size_t size);
+static void tcache_free(void* bp);
+#endif
+
+#ifdef PERCPU
+/* The cache of one CPU: a stack of objects per slab class. The count is the commit word of every
+ * push and pop, so an interrupted one leaves the bin as it was.
+ */
+typedef struct {
+    unsigned int count[TCACHE_BINS];
+    void* slot[TCACHE_BINS][PCPU_LIMIT];
+} pcpu_cache_t;
+
+static pcpu_cache_t* PCPU = NULL; //one cache per configured CPU, NULL if rseq isn't available at all
+static int PCPU_CPUS = 0;
+
+/* The calling thread's rseq area, registered by glibc */
+#define RSEQ_AREA() ((struct rseq*)((char*)__builtin_thread_pointer() + __rseq_offset))
+
+static void pcpu_init(void);
+static int pcpu_ready(void);
+static void* pcpu_malloc(int i, size_t size);
+static void pcpu_free(void* bp, int i);
+#endif
 
 /* 
  * mm_init - initialize the malloc package.
  * This command is always called first before anything happens.
- * Here, we create a start/end block that is always marked as allocated to prevent having
- * to check whether the block is at the start/end of the heap while coalescing.
+ * With arenas, every arena gets a fresh heap here too.
  */
 int mm_init(void) {
+#ifdef THREADS
+    if (ARENA_REGION == NULL) {
+        //reserve address space for all the other arenas in one go. Pages only get used once touched
+#ifdef HUGE_PAGES
+        //with room to start it on a huge page boundary, so every arena is made of whole segments
+        size_t len = (NUM_ARENAS - 1)*ARENA_SIZE + HUGE_PAGE_SIZE;
+#else
+        size_t len = (NUM_ARENAS - 1)*ARENA_SIZE;
+#endif
+        ARENA_REGION = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (ARENA_REGION == MAP_FAILED) {
+            ARENA_REGION = NULL;
+            return -1;
+        }
+#ifdef HUGE_PAGES
+        void* start = HUGE_UP(ARENA_REGION);
+        if (start > ARENA_REGION) munmap(ARENA_REGION, start - ARENA_REGION);
+        munmap(start + (NUM_ARENAS - 1)*ARENA_SIZE, ARENA_REGION + len - (start + (NUM_ARENAS - 1)*ARENA_SIZE));
+        ARENA_REGION = start;
+        madvise(ARENA_REGION, (NUM_ARENAS - 1)*ARENA_SIZE, MADV_HUGEPAGE);
+#endif
+        for (int i = 0; i < NUM_ARENAS; i++) {
+            pthread_mutex_init(&ARENAS[i].lock, NULL);
+        }
+    } else {
+        //starting over: hand the old arenas' pages back
+        madvise(ARENA_REGION, (NUM_ARENAS - 1)*ARENA_SIZE, MADV_DONTNEED);
+    }
+
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        LOCK_ARENA(&ARENAS[i]); //the purging thread may be looking at it
+        if (i > 0) {
+            CUR_ARENA->brk = ARENA_REGION + (i - 1)*ARENA_SIZE;
+            CUR_ARENA->top = CUR_ARENA->brk + ARENA_SIZE;
+        } else {
+            CUR_ARENA->brk = CUR_ARENA->top = mem_sbrk(0);
+        }
+        CUR_ARENA->remote_frees = NULL;
+        int failed = init_heap();
+        CUR_ARENA->heap = FREE_LISTS;
+        UNLOCK_ARENA();
+        if (failed == -1) return -1;
+    }
+#ifdef PURGE_DECAY
+    pthread_once(&DECAY_ONCE, decay_start);
+#endif
+#else
+    HEAP_BRK = HEAP_TOP = mem_sbrk(0);
+    if (init_heap() == -1) return -1;
+#endif
+
+#ifdef TCACHE
+    HEAP_GEN++; //whatever threads have cached points into the old heap
+#endif
+#ifdef PERCPU
+    pcpu_init(); //and so does whatever the CPUs have
+#endif
+    return 0;
+}
+
+/*
+ * init_heap - lay out an empty heap: the segregated list roots at the start, then a start/end
+ * block that is always marked as allocated to prevent having to check whether the block is
+ * at the start/end of the heap while coalescing.
+ */
+static int init_heap(void) {
     /* create initial pointer to empty heap */
-    void* heap_listp = mem_sbrk(4*WSIZE);
-    if (heap_listp == (void*) -1) return -1;
+    FREE_LISTS = HEAP_BRK; //heap_sbrk measures the heap from here
+#ifdef BUDDY
+    if (heap_sbrk(HEAD_WORDS*WSIZE) == (void*) -1) return -1;
+    if (heap_sbrk(BUDDY_BASE - HEAP_BRK) == (void*) -1) return -1; //blocks start at BUDDY_BASE, no prolog/epilog needed
+#else
+    if (heap_sbrk(HEAD_WORDS*WSIZE + 3*WSIZE) == (void*) -1) return -1;
+#endif
+
+    HEAP_GROW = DEFAULT_CHUNKSIZE;
+
+    //every list starts out empty, and so does every bitmap
+    for (int i = 0; i < HEAD_WORDS; i++) {
+        WRITE(FREE_LISTS + i*WSIZE, 0);
+    }
+
+    //forget the slab pages of whatever heap was here before
+    int heap = HEAP_INDEX();
+    for (unsigned int i = 0; i < (SLAB_MAP_TOP[heap] + 31)/32; i++) {
+        SLAB_MAP[heap][i] = 0;
+    }
+    SLAB_MAP_TOP[heap] = 0;
 
-    //inserting start/end blocks. Called prolog/epilog in textbook
-    WRITE(heap_listp, 0); //alignment padding
-    WRITE(heap_listp + (1*WSIZE), PACK(DSIZE, 1)); //start block header
-    WRITE(heap_listp + (2*WSIZE), PACK(DSIZE, 1)); //start block footer
-    WRITE(heap_listp + (3*WSIZE), PACK(0, 1)); //end block header (for the next free block)
+    FAST_BLOCKS[heap] = 0;
+#ifdef DEFER_COALESCE
+    UNSORTED_BYTES[heap] = 0;
+#endif
+#ifdef NEXT_FIT
+    for (int i = 0; i < NUM_CLASSES; i++) {
+        ROVER[heap][i] = NULL;
+    }
+#endif
+#ifdef SIDE_LISTS
+    for (int i = 0; i < NUM_CLASSES; i++) {
+        SIDE_COUNT[heap][i] = 0;
+    }
+#endif
+    PURGE_COUNT[heap] = PURGE_BYTES[heap] = 0;
+#ifdef PURGE_DECAY
+    DIRTY_BYTES[heap] = DECAY_LAST[heap] = 0;
+    for (int i = 0; i < DECAY_EPOCHS; i++) {
+        DECAY_NEW[heap][i] = 0;
+    }
+#endif
+
+#ifndef BUDDY
+    //inserting start/end blocks right after the roots. Called prolog/epilog in textbook
+    //the last head word takes the place of the alignment padding
+    void* heap_listp = FREE_LISTS + HEAD_WORDS*WSIZE;
+    WRITE(heap_listp, PACK(DSIZE, 1, 1)); //start block header
+    WRITE(heap_listp + (1*WSIZE), PACK(DSIZE, 1, 1)); //start block footer. Not needed anymore, but keeps the alignment
+    WRITE(heap_listp + (2*WSIZE), PACK(0, 1, 1)); //end block header (for the next free block)
+#endif
 
     return 0;
 }
 
+/*
+ * heap_sbrk - mem_sbrk for the current heap. Room left over from a trim gets used up before asking
+ * mem_sbrk for more, and arenas past the first only ever grow inside their own reserved region.
+ * With -DHUGE_PAGES, mem_sbrk is asked for whole huge page segments.
+ */
+static void* heap_sbrk(size_t incr) {
+    void* old_brk = HEAP_BRK;
+
+    if (old_brk + incr > HEAP_TOP) {
+#ifdef THREADS
+        if (CUR_ARENA != &ARENAS[0]) return (void*) -1;
+#endif
+        if ((size_t)(old_brk + incr - SLAB_PAGEP(FREE_LISTS)) > MAX_HEAP_SPAN) return (void*) -1;
+#ifdef HUGE_PAGES
+        //take the rest of the segment the new end falls in as well, and have it all in huge pages
+        void* new_top = HUGE_UP(old_brk + incr);
+        if (mem_sbrk(new_top - HEAP_TOP) == (void*) -1) {
+            new_top = old_brk + incr; //no room for the whole segment, make do with what was asked for
+            if (mem_sbrk(new_top - HEAP_TOP) == (void*) -1) return (void*) -1;
+        }
+        if (PAGE_DOWN(new_top) > PAGE_UP(HEAP_TOP)) {
+            madvise(PAGE_UP(HEAP_TOP), PAGE_DOWN(new_top) - PAGE_UP(HEAP_TOP), MADV_HUGEPAGE);
+        }
+        HEAP_TOP = new_top;
+#else
+        if (mem_sbrk(old_brk + incr - HEAP_TOP) == (void*) -1) return (void*) -1;
+        HEAP_TOP = old_brk + incr;
+#endif
+    }
+    HEAP_BRK = old_brk + incr;
+    return old_brk;
+}
+
+/*
+ * grow_size - how much to extend the heap by to make room for asize more bytes. Extensions double
+ * in size as the heap grows, up to GROW_MAX, so a heap that keeps growing needs few mem_sbrk calls
+ * and few fresh free blocks to coalesce. trim_heap halves them again.
+ */
+static size_t grow_size(size_t asize) {
+    size_t size = MAX(asize, HEAP_GROW);
+    if (HEAP_GROW < GROW_MAX && HEAP_GROW*GROW_SHARE <= (size_t)(HEAP_BRK - FREE_LISTS)) HEAP_GROW *= 2;
+    return size;
+}
+
+/*
+ * mm_trim - give the free space at the end of every heap back to the OS, leaving at most about
+ * pad bytes of it. Returns 1 if any memory was released, 0 otherwise.
+ */
+int mm_trim(size_t pad) {
+    int trimmed = 0;
+#ifdef THREADS
+    for (int i = 0; i < NUM_ARENAS; i++) {
+        LOCK_ARENA(&ARENAS[i]);
+        drain_remote_frees(); //these may well be what's sitting at the end
+        consolidate_bins(1);
+        trimmed |= trim_heap(pad);
+        UNLOCK_ARENA();
+    }
+#else
+    consolidate_bins(1);
+    trimmed = trim_heap(pad);
+#endif
+    return trimmed;
+}
+
+#ifndef BUDDY
+/*
+ * trim_heap - shrink the free block at the end of the current heap down to pad bytes (rounded up
+ * so the heap ends on a page boundary), move the epilogue back, and drop the pages behind it.
+ * The heap keeps the address range, so growing back into it later needs no mem_sbrk.
+ */
+static int trim_heap(size_t pad) {
+    void* end = HEAP_BRK; //the epilogue header is the last word before it
+    if (GET_PREV_ALLOC(HDRP(end))) return 0; //the last block is allocated, nothing to trim
+
+    void* bp = PREV_BLKP(end);
+    void* new_end = PAGE_UP(bp + MAX(pad, MIN_BLOCK_SIZE));
+    if (new_end >= end) return 0;
+
+    //the block gets smaller, so it may belong to another class now
+    size_t size = new_end - bp;
+    fb_patching(bp);
+    WRITE(HDRP(bp), PACK(size, 1, 0) | IS_PURGED(HDRP(bp)));
+    WRITE(FTRP(bp), PACK(size, 0, 0));
+    add_free(bp);
+    WRITE(HDRP(new_end), PACK(0, 0, 1)); //new epilogue header
+    HEAP_BRK = new_end;
+    HEAP_GROW = MAX(HEAP_GROW/2, DEFAULT_CHUNKSIZE); //we grew too far, so back off a little
+
+    //only whole pages can go. The one the old end falls in can go too unless it's past what the heap owns,
+    //since whatever follows the heap may be using it. Leaving it would strand a whole huge page with -DHUGE_PAGES
+    void* first_page = PURGE_UP(new_end);
+    void* last_page = PURGE_UP(end) <= HEAP_TOP ? PURGE_UP(end) : PURGE_DOWN(end);
+    if (last_page > first_page) madvise(first_page, last_page - first_page, MADV_DONTNEED);
+    return 1;
+}
+
 
 /* 
  * extend_heap - extend the heap by the number of words given.
@@ -91,17 +828,18 @@ static void* extend_heap(size_t words) {
 
     //allocate an even number of words to maintain 8 bits alignment
     size = (words % 2) ? (words + 1) * WSIZE : words * WSIZE; //0 is false, so words % 2 == 0 eval to false
-    bp = mem_sbrk(size);
+    bp = heap_sbrk(size);
     if (bp == (void*) -1) return NULL;
 
-    //initialize free block header/footer
-    WRITE(HDRP(bp), PACK(size, 0)); //new free header
-    WRITE(FTRP(bp), PACK(size, 0)); //new free footer
-    WRITE(HDRP(NEXT_BLKP(bp)), PACK(0, 1)); //new epilogue header
+    //initialize free block header/footer. The header replaces the old epilogue, which knows about the block before it
+    WRITE(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)), 0)); //new free header
+    WRITE(FTRP(bp), PACK(size, 0, 0)); //new free footer
+    WRITE(HDRP(NEXT_BLKP(bp)), PACK(0, 0, 1)); //new epilogue header
 
     //coalesce if block previous of extension was free;
     return handle_free(bp);
 }
+#endif
 
 /* 
  * mm_malloc - Allocate a block. Always allocate a block that is a multiple of the alignment (8 bits)
@@ -109,182 +847,2217 @@ static void* extend_heap(size_t words) {
 void* mm_malloc(size_t size) {
     if (size == 0) return NULL;
 
-    size_t asize; //adjusted block size
+#ifdef TCACHE
+    if (size <= SLAB_MAX_SIZE) return tcache_malloc(size);
+#endif
+    if (size >= MMAP_THRESHOLD) return mmap_block(size);
+    return arena_malloc(size);
+}
 
-    //adjusting size to include overhead and alignment requirements
-    if (size <= DSIZE) {
-        asize = 2 * DSIZE; //minimum = header + footer (DSIZE) + size (<= DSIZE)
-    } else {
-        asize = ((size + DSIZE + (DSIZE - 1)) / DSIZE) * DSIZE;
-        //formula from the book
-        //i understand the idea but explaining it in words is hard
+/*
+ * arena_malloc - heap_malloc on the calling thread's arena, falling back to the main heap if
+ * that arena has run out of room
+ */
+static void* arena_malloc(size_t size) {
+    LOCK_ARENA(my_arena());
+#ifdef THREADS
+    drain_remote_frees(); //blocks other threads gave back while we weren't holding the lock
+#endif
+    void* bp = heap_malloc(size);
+    UNLOCK_ARENA();
+
+#ifdef THREADS
+    if (bp == NULL && MY_ARENA != &ARENAS[0]) {
+        LOCK_ARENA(&ARENAS[0]);
+        drain_remote_frees();
+        bp = heap_malloc(size);
+        UNLOCK_ARENA();
     }
+#endif
+    return bp;
+}
+
+/*
+ * heap_malloc - allocate size bytes from the current heap: a slab object if it's small,
+ * a boundary-tagged block otherwise
+ */
+static void* heap_malloc(size_t size) {
+    if (size <= SLAB_MAX_SIZE) return slab_malloc(SLAB_CLASS(size));
+    return malloc_block(adjust_size(size)); //adjusted block size
+}
 
+/*
+ * malloc_block - allocate a block of exactly asize bytes (already adjusted) from the heap
+ */
+static void* malloc_block(size_t asize) {
     void* bp;
-    //search the free list for a fit
+    //a block of just this size freed lately is the cheapest fit there is
+    if (IS_FAST_SIZE(asize) && (bp = GET_LINK(FAST_ROOTP(asize))) != NULL) {
+        SET_LINK(FAST_ROOTP(asize), GET_LINK(NEXTP(bp)));
+        FAST_BLOCKS[HEAP_INDEX()]--;
+        return bp;
+    }
+
+    //search the free list for a fit, coalescing the fast bins first if that's what it takes
     bp = find_fit(asize);
+    if (bp == NULL && consolidate_bins(0)) bp = find_fit(asize);
     if (bp != NULL) {
         handle_malloc(bp, asize); //if found, handle allocation, then return pointer to block
         return bp;
     };
 
     //no fit found. get more memory
-    size_t extend_size = MAX(asize, DEFAULT_CHUNKSIZE);
-    bp = extend_heap(extend_size/WSIZE);
+    bp = extend_heap(grow_size(asize)/WSIZE);
     if (bp == NULL) return NULL; //getting more memory fail
     handle_malloc(bp, asize); //otherwise, handle allocation, then return pointer to block
     return bp;
 }
 
 /*
- * find_fit - given size of block we are allocating, find in the free list to see whether
- * there exists a free block large enough
+ * adjust_size - adjust a requested payload size to include overhead and alignment requirements.
+ * A size so big that the overhead would wrap it around comes out as the biggest size there is,
+ * which nothing can satisfy, rather than as a tiny one
  */
-static void* find_fit(size_t asize) {
-    void* curr_free = FREE_LIST_ROOT;
-    //simple linked list traversal, checking whether the size is large enough
-    while (curr_free != NULL) {
-        size_t cf_size = GET_SIZE(HDRP(curr_free));
-        if (cf_size < asize) {
-            curr_free = READ(NEXTP(curr_free));
-        }
-        else {
-            break;
-        }
+static size_t adjust_size(size_t size) {
+    if (size <= DSIZE + WSIZE) {
+        return MIN_BLOCK_SIZE; //header (WSIZE) + size (<= 12), or enough room for a free block later
     }
-    return curr_free;
+    if (size > SIZE_MAX - WSIZE - (DSIZE - 1)) return SIZE_MAX & ~(size_t)(DSIZE - 1);
+    return ((size + WSIZE + (DSIZE - 1)) / DSIZE) * DSIZE;
+    //formula from the book, except allocated blocks only pay for a header
+    //i understand the idea but explaining it in words is hard
 }
 
+#if defined(BUDDY)
+/* The buddy engine. The heap is a row of BUDDY_MAX_SIZE blocks from BUDDY_BASE on, each split in
+ * halves as far as requests need. Every block is a power of two in size and sits at a multiple of
+ * that size from BUDDY_BASE, so the only block it can merge with, its buddy, is found by flipping
+ * one bit of its offset. That leaves the header as the only boundary tag: no footers, and no prev
+ * alloc bits. Class i holds the free blocks of size 2^(i + BUDDY_MIN_ORDER).
+ */
+
 /*
- * handle_malloc - handle the allocation of a block with size asize at address bp
+ * find_fit - given size of block we are allocating, find the head of the smallest non-empty class
+ * that fits it. Every block of a class has the same size, so this never walks a list.
  */
-static void handle_malloc(void* bp, size_t asize) {
-    size_t cf_size = GET_SIZE(HDRP(bp)); //get size of current free block
-    size_t rem_size = cf_size - asize; //get remaining size after the block is allocated
+static void* find_fit(size_t asize) {
+    int class = get_class(asize);
+    if (class >= BUDDY_ORDERS) return NULL; //bigger than a whole top-order block
 
-    fb_patching(bp, &FREE_LIST_ROOT); //see explanation of what this does in the comment for the function.
+    unsigned int fits = READ(BITMAPP) & (~0u << class);
+    if (fits == 0) return NULL;
+    return GET_LINK(ROOTP(__builtin_ctz(fits)));
+}
 
-    if (rem_size < DSIZE * 2) { //if the remainder is not enough to construct a free block, just return the whole block             
-        //mark off malloc block with header/footer information
-        WRITE(HDRP(bp), PACK(cf_size, 1));
-        WRITE(FTRP(bp), PACK(cf_size, 1)); //ftrp calculation based on size from header
-    } else { //otherwise, create a new free block from the remainder
-        //mark off malloc block
-        WRITE(HDRP(bp), PACK(asize, 1));
-        WRITE(FTRP(bp), PACK(asize, 1));
+/*
+ * get_class - map a block size to its order, counting from BUDDY_MIN_ORDER. Sizes in between round up
+ */
+static int get_class(size_t size) {
+    if (size <= MIN_BLOCK_SIZE) return 0;
+    return 8*sizeof(unsigned long) - __builtin_clzl(size - 1) - BUDDY_MIN_ORDER; //ceil(log2(size)) - BUDDY_MIN_ORDER
+}
 
-        //construct new free block
-        void* new_free = NEXT_BLKP(bp);
-        WRITE(HDRP(new_free), PACK(rem_size, 0));
-        WRITE(FTRP(new_free), PACK(rem_size, 0));
+/*
+ * set_class_bit/clear_class_bit - mark a class's list as non-empty/empty in the bitmap
+ */
+static void set_class_bit(int class) {
+    WRITE(BITMAPP, READ(BITMAPP) | (1u << class));
+}
 
-        //add new free block to beginning
-        add_free(new_free, &FREE_LIST_ROOT);
-    }
+static void clear_class_bit(int class) {
+    WRITE(BITMAPP, READ(BITMAPP) & ~(1u << class));
 }
 
 /*
- * mm_free - Freeing a block.
- * input is a pointer to a previously malloc'd block
+ * handle_malloc - take the free block bp off its list and halve it until it is the smallest block
+ * that holds asize, freeing the upper half every time
  */
-void mm_free(void *bp) {
-    size_t size = GET_SIZE(HDRP(bp)); //get size of block to be freed
+static void handle_malloc(void* bp, size_t asize) {
+    size_t size = GET_SIZE(HDRP(bp));
+    size_t want = BUDDY_SIZE(asize);
+    size_t purged = IS_PURGED(HDRP(bp)); //the upper halves are inside the purged pages, so they stay purged
+    fb_patching(bp);
 
-    WRITE(HDRP(bp), PACK(size, 0)); //set alloc bit to 0
-    WRITE(FTRP(bp), PACK(size, 0));
-    handle_free(bp); //handle coalescing, basically
+    while (size > want) {
+        size /= 2;
+        WRITE(HDRP(bp + size), PACK(size, 0, 0) | purged);
+        add_free(bp + size);
+    }
+    WRITE(HDRP(bp), PACK(size, 0, 1));
 }
+
 /*
- * handle_free - handle coalescing and correct linking of free blocks
+ * handle_free - merge the free block bp with its buddy for as long as the buddy is free and
+ * whole (not split up), then add the result to the list of its class
  */
 static void* handle_free(void* bp) {
-    void* prev_block = PREV_BLKP(bp); //get the immediate previous and next blocks
-    void* next_block = NEXT_BLKP(bp);
-    size_t prev_alloc = GET_ALLOC(FTRP(prev_block)); //get whether the prev/next block are free
-    size_t next_alloc = GET_ALLOC(HDRP(next_block));
-    size_t size = GET_SIZE(HDRP(bp)); //get size of current block
+    size_t size = GET_SIZE(HDRP(bp));
 
-    if (prev_alloc && next_alloc) { //case 1: both prev/next blocks are alloc'd
-        //do nothing
+    while (size < BUDDY_MAX_SIZE) {
+        void* buddy = BUDDY_BLKP(bp, size);
+        if (GET_ALLOC(HDRP(buddy)) || GET_SIZE(HDRP(buddy)) != size) break;
+
+        fb_patching(buddy);
+        if (buddy < bp) bp = buddy;
+        size *= 2;
+        WRITE(HDRP(bp), PACK(size, 0, 0));
     }
+    add_free(bp);
+    return bp;
+}
 
-    else if (prev_alloc && !next_alloc) { //case 2: prev alloc'd next free
-        fb_patching(next_block, &FREE_LIST_ROOT);
+/*
+ * free_tail - where the run of free top-order blocks at the end of the current heap starts
+ */
+static void* free_tail(void) {
+    void* start = HEAP_BRK;
+    while (start > BUDDY_BASE) {
+        void* hdr = start - BUDDY_MAX_SIZE;
+        if (GET_ALLOC(hdr) || GET_SIZE(hdr) != BUDDY_MAX_SIZE) break;
+        start = hdr;
+    }
+    return start;
+}
 
-        //coalescing next block and new block, updating new block's size
-        size += GET_SIZE(HDRP(next_block));
-        WRITE(HDRP(bp), PACK(size, 0));
-        WRITE(FTRP(next_block), PACK(size, 0));
+/*
+ * coalesce_block - what free_block does, except the big free block that comes out of it only gets
+ * purged if purge is set
+ */
+static void coalesce_block(void* bp, int purge) {
+    size_t size = GET_SIZE(HDRP(bp));
+
+    //the part of the merged block that may hold dirty pages: bp itself, and whichever buddies
+    //are about to merge in without having been purged. Purged ones only need the page their links are on
+    void* lo = bp;
+    void* hi = bp + size;
+    void* b = bp;
+    for (size_t s = size; s < BUDDY_MAX_SIZE; s *= 2) {
+        void* buddy = BUDDY_BLKP(b, s);
+        if (GET_ALLOC(HDRP(buddy)) || GET_SIZE(HDRP(buddy)) != s) break;
+
+        if (!IS_PURGED(HDRP(buddy))) {
+            if (buddy < lo) lo = buddy;
+            hi = MAX(hi, buddy + s);
+        } else if (buddy > b) {
+            hi = MAX(hi, buddy + FREE_LINKS_SIZE);
+        } else if (buddy + s - DSIZE < lo) {
+            lo = buddy + s - DSIZE; //its last page holds the header of the half above it
+        }
+        if (buddy < b) b = buddy;
     }
 
-    else if (!prev_alloc && next_alloc) { //case 3: prev free next alloc'd
-        fb_patching(prev_block, &FREE_LIST_ROOT);
+    WRITE(HDRP(bp), PACK(size, 0, 0)); //set alloc bit to 0
+    bp = handle_free(bp);
+    size = GET_SIZE(HDRP(bp));
 
-        //coalescing prev block and new block, updating new block's size
-        size += GET_SIZE(HDRP(prev_block));
-        WRITE(HDRP(prev_block), PACK(size, 0));
-        WRITE(FTRP(bp), PACK(size, 0));
-        bp = prev_block;
+    //enough whole top-order blocks free at the end of the heap: give most of them back
+    if (size == BUDDY_MAX_SIZE && (size_t)(HEAP_BRK - free_tail()) >= TRIM_THRESHOLD) {
+        if (trim_heap(TRIM_PAD) && bp >= HEAP_BRK) return; //bp went with them
     }
 
-    else { //case 4: both free
-        //cut off both prev/next blocks
-        fb_patching(prev_block, &FREE_LIST_ROOT);
-        fb_patching(next_block, &FREE_LIST_ROOT);
+    if (purge && size >= PURGE_THRESHOLD) {
+        purge_pages(bp, lo, hi);
+        WRITE(HDRP(bp), READ(HDRP(bp)) | PURGED);
+    }
+}
 
-        //coalescing
-        size = size + GET_SIZE(HDRP(prev_block)) + GET_SIZE(HDRP(next_block));
-        WRITE(HDRP(prev_block), PACK(size, 0));
-        WRITE(FTRP(next_block), PACK(size, 0));
-        bp = prev_block;
+/*
+ * extend_heap - extend the heap by at least the number of words given, in whole top-order blocks,
+ * and return the first of them. They all go on the free list.
+ */
+static void* extend_heap(size_t words) {
+    size_t size = (words*WSIZE + BUDDY_MAX_SIZE - 1) & ~(size_t)(BUDDY_MAX_SIZE - 1);
+    void* start = heap_sbrk(size);
+    if (start == (void*) -1) return NULL;
+
+    //add them highest first, so the lowest ends up at the head of the list
+    for (size_t off = size; off > 0; off -= BUDDY_MAX_SIZE) {
+        void* bp = start + off - BUDDY_MAX_SIZE + WSIZE;
+        WRITE(HDRP(bp), PACK(BUDDY_MAX_SIZE, 0, 0));
+        add_free(bp);
     }
+    return start + WSIZE;
+}
 
-    //add free block to beginning of list
-    add_free(bp, &FREE_LIST_ROOT);
+/*
+ * trim_heap - give the whole free top-order blocks at the end of the current heap back to the OS,
+ * keeping enough of them to cover pad bytes. The heap only ever shrinks by whole top-order blocks,
+ * so that BUDDY_BASE stays where every block's buddy is reckoned from.
+ */
+static int trim_heap(size_t pad) {
+    void* end = HEAP_BRK;
+    void* new_end = free_tail();
+    new_end += (pad + BUDDY_MAX_SIZE - 1) & ~(size_t)(BUDDY_MAX_SIZE - 1);
+    if (new_end >= end) return 0;
 
-    return bp;
+    for (void* hdr = new_end; hdr < end; hdr += BUDDY_MAX_SIZE) {
+        fb_patching(hdr + WSIZE);
+    }
+    HEAP_BRK = new_end;
+    HEAP_GROW = MAX(HEAP_GROW/2, DEFAULT_CHUNKSIZE); //we grew too far, so back off a little
+
+    //only whole pages can go. The one the new end falls in still holds the tail of the block before
+    //it, the one the old end falls in may be in use by whatever follows the heap if the heap doesn't own it
+    void* first_page = PURGE_UP(new_end);
+    void* last_page = PURGE_UP(end) <= HEAP_TOP ? PURGE_UP(end) : PURGE_DOWN(end);
+    if (last_page > first_page) madvise(first_page, last_page - first_page, MADV_DONTNEED);
+    return 1;
 }
 
 /*
- * add_free - add bp to beginning of free list
+ * realloc_block - the body of mm_realloc, resizing ptr to a block of asize bytes (already adjusted).
+ * A block shrinks by freeing its upper halves, and grows in place by taking in its buddies, as long
+ * as it's the lower half every time and they're free and whole. Otherwise it moves.
  */
-static void add_free(void* bp, void** free_list_root) {
-    WRITE(PREVP(bp), NULL); //set previous pointer to NULL (since we're adding it at root)
-    //if free_list_root is not null, we need to make bp's next point to the old_root
-    //otherwise (empty list), just set next to null
-    if (*free_list_root) {
-        void* root_next = READ(NEXTP(*free_list_root));
-        if (root_next) WRITE(PREVP(root_next), bp);
-        WRITE(NEXTP(bp), root_next);
-    } else {
-        WRITE(NEXTP(bp), NULL);
+static void* realloc_block(void* ptr, size_t asize) {
+    size_t old_size = GET_SIZE(HDRP(ptr));
+    size_t want = BUDDY_SIZE(asize);
+
+    if (want <= old_size) {
+        shrink_block(ptr, asize);
+        return ptr;
+    }
+
+    //check the whole way up first, so nothing gets taken off its list unless the block can grow
+    size_t size;
+    for (size = old_size; size < want; size *= 2) {
+        void* buddy = BUDDY_BLKP(ptr, size);
+        if (buddy < ptr || GET_ALLOC(HDRP(buddy)) || GET_SIZE(HDRP(buddy)) != size) break;
+    }
+    if (size == want) {
+        for (size = old_size; size < want; size *= 2) {
+            fb_patching(BUDDY_BLKP(ptr, size));
+        }
+        WRITE(HDRP(ptr), PACK(want, 0, 1));
+        return ptr;
     }
-    *free_list_root = bp;
+
+    void* new_ptr = malloc_block(asize);
+    if (new_ptr == NULL) return NULL;
+    memcpy(new_ptr, ptr, old_size - WSIZE);
+    free_block(ptr);
+    return new_ptr;
 }
 
 /*
- * fb_patching - Patch the previous/next free blocks of bp together
- * Also update free_list_root to point at next free block from bp if bp is already root
- * Essentially, it's an utility for removing bp from the free list
+ * shrink_block - cut an allocated block at bp down to the smallest block that holds asize,
+ * freeing the upper halves. Their buddy is bp every time, so none of them can merge
  */
-static void fb_patching(void* bp, void** free_list_root) {
-    //getting the relevant blocks for pointer reallocating
-    void* bp_prev = READ(PREVP(bp));
-    void* bp_next = READ(NEXTP(bp));
+static void shrink_block(void* bp, size_t asize) {
+    size_t size = GET_SIZE(HDRP(bp));
+    size_t want = BUDDY_SIZE(asize);
 
-    //rearranging prev next for prev block prev/next
-    if (bp_prev) {
-        WRITE(NEXTP(bp_prev), bp_next);
+    while (size > want) {
+        size /= 2;
+        WRITE(HDRP(bp + size), PACK(size, 0, 0));
+        add_free(bp + size);
     }
-    else {
-        *free_list_root = bp_next;
+    WRITE(HDRP(bp), PACK(size, 0, 1));
+}
+
+/*
+ * malloc_aligned_block - allocate a block of asize bytes whose payload starts on an align boundary.
+ * A block at least align bytes big starts on one already for any align up to a page, which covers
+ * the slab pages. Nothing bigger is supported.
+ */
+static void* malloc_aligned_block(size_t asize, size_t align) {
+    if (align > OS_PAGE_SIZE) return NULL;
+    return malloc_block(MAX(asize, align));
+}
+#elif defined(TLSF)
+/*
+ * find_fit - given size of block we are allocating, find the head of the first non-empty list
+ * whose blocks are all guaranteed to be large enough. This never walks a list, so it's O(1).
+ */
+static void* find_fit(size_t asize) {
+    //round asize up to the next class boundary, so that any block of the class we land in fits
+    if (asize >= SMALL_BLOCK_SIZE) {
+        int msb = (8*sizeof(unsigned long) - 1) - __builtin_clzl(asize);
+        asize += (1ul << (msb - SL_BITS)) - 1;
+    }
+    int class = get_class(asize);
+    int fl = class / SL_COUNT;
+    int sl = class % SL_COUNT;
+    if (fl >= FL_COUNT) return NULL; //bigger than anything the heap can hold
+
+    //look for a non-empty class at or above sl in the same first level
+    unsigned int sl_map = READ(SL_BITMAPP(fl)) & (~0u << sl);
+    if (sl_map == 0) {
+        //none, so take the smallest non-empty class of the first non-empty bigger first level
+        unsigned int fl_map = READ(FL_BITMAPP) & (~0u << (fl + 1));
+        if (fl_map == 0) return NULL;
+        fl = __builtin_ctz(fl_map);
+        sl_map = READ(SL_BITMAPP(fl));
     }
-    if (bp_next) WRITE(PREVP(bp_next), bp_prev);
+    sl = __builtin_ctz(sl_map);
+    return GET_LINK(ROOTP(fl*SL_COUNT + sl));
 }
 
 /*
- * mm_realloc - Implemented simply in terms of mm_malloc and mm_free
+ * get_class - map a block size to the index of its (first level, second level) free list
  */
-void* mm_realloc(void *ptr, size_t size) {
-    //TBD
+static int get_class(size_t size) {
+    if (size < SMALL_BLOCK_SIZE) return size / DSIZE; //first level 0, one class per 8 bytes
+
+    int msb = (8*sizeof(unsigned long) - 1) - __builtin_clzl(size);
+    int fl = msb - (SL_BITS + 2); //SMALL_BLOCK_SIZE = 2^(SL_BITS+3) is the first size of first level 1
+    int sl = (size >> (msb - SL_BITS)) & (SL_COUNT - 1); //the SL_BITS bits right below the msb
+    return fl*SL_COUNT + sl;
+}
+
+/*
+ * set_class_bit/clear_class_bit - mark a class's list as non-empty/empty in both bitmap levels
+ */
+static void set_class_bit(int class) {
+    int fl = class / SL_COUNT;
+    WRITE(SL_BITMAPP(fl), READ(SL_BITMAPP(fl)) | (1u << (class % SL_COUNT)));
+    WRITE(FL_BITMAPP, READ(FL_BITMAPP) | (1u << fl));
+}
+
+static void clear_class_bit(int class) {
+    int fl = class / SL_COUNT;
+    WRITE(SL_BITMAPP(fl), READ(SL_BITMAPP(fl)) & ~(1u << (class % SL_COUNT)));
+    if (READ(SL_BITMAPP(fl)) == 0) WRITE(FL_BITMAPP, READ(FL_BITMAPP) & ~(1u << fl));
+}
+#else
+/* The last class, every block over 1KB, isn't a list. Its root is the root of a splay tree ordered
+ * by block size, so find_fit gets the best fit among the big blocks in O(log n) amortized instead of
+ * walking a long list first-fit. Each size has a single node in the tree. Further blocks of that
+ * size hang off the node in a list through NEXTP/PREVP, and the node is the one whose prev is NULL.
+ */
+#define TREE_CLASS (NUM_CLASSES - 1)
+#define TREE_ROOTP ROOTP(TREE_CLASS)
+
+/*
+ * splay - top-down splay (Sleator and Tarjan) of the tree rooted at t for the given key, in the
+ * size tree or an address tree depending on by_addr. Returns the new root, which is the node with
+ * that key if there is one, otherwise the closest node below or above it.
+ */
+static void* splay(void* t, size_t key, int by_addr) {
+    unsigned int spare[FREE_LINKS_SIZE/WSIZE] = {0}; //stands in for a node, to collect the left and right trees in
+    void* l = spare;
+    void* r = spare;
+    if (t == NULL) return NULL;
+
+    for (;;) {
+        if (key < KEY(t, by_addr)) {
+            void* y = GET_LINK(LEFTP(t, by_addr));
+            if (y == NULL) break;
+            if (key < KEY(y, by_addr)) { //rotate right
+                SET_LINK(LEFTP(t, by_addr), GET_LINK(RIGHTP(y, by_addr)));
+                SET_LINK(RIGHTP(y, by_addr), t);
+                t = y;
+                if (GET_LINK(LEFTP(t, by_addr)) == NULL) break;
+            }
+            SET_LINK(LEFTP(r, by_addr), t); //t and everything right of it go to the right tree
+            r = t;
+            t = GET_LINK(LEFTP(t, by_addr));
+        } else if (key > KEY(t, by_addr)) {
+            void* y = GET_LINK(RIGHTP(t, by_addr));
+            if (y == NULL) break;
+            if (key > KEY(y, by_addr)) { //rotate left
+                SET_LINK(RIGHTP(t, by_addr), GET_LINK(LEFTP(y, by_addr)));
+                SET_LINK(LEFTP(y, by_addr), t);
+                t = y;
+                if (GET_LINK(RIGHTP(t, by_addr)) == NULL) break;
+            }
+            SET_LINK(RIGHTP(l, by_addr), t); //t and everything left of it go to the left tree
+            l = t;
+            t = GET_LINK(RIGHTP(t, by_addr));
+        } else {
+            break;
+        }
+    }
+
+    //put the left and right trees under t
+    SET_LINK(RIGHTP(l, by_addr), GET_LINK(LEFTP(t, by_addr)));
+    SET_LINK(LEFTP(r, by_addr), GET_LINK(RIGHTP(t, by_addr)));
+    SET_LINK(LEFTP(t, by_addr), GET_LINK(RIGHTP(spare, by_addr)));
+    SET_LINK(RIGHTP(t, by_addr), GET_LINK(LEFTP(spare, by_addr)));
+    return t;
+}
+
+/*
+ * splay_root - make bp, which isn't in the tree, the root above t, the root that splaying for bp's
+ * key just returned
+ */
+static void splay_root(void* bp, void* t, int by_addr) {
+    if (t == NULL) {
+        SET_LINK(LEFTP(bp, by_addr), NULL);
+        SET_LINK(RIGHTP(bp, by_addr), NULL);
+    } else if (KEY(bp, by_addr) < KEY(t, by_addr)) {
+        SET_LINK(LEFTP(bp, by_addr), GET_LINK(LEFTP(t, by_addr)));
+        SET_LINK(RIGHTP(bp, by_addr), t);
+        SET_LINK(LEFTP(t, by_addr), NULL);
+    } else {
+        SET_LINK(RIGHTP(bp, by_addr), GET_LINK(RIGHTP(t, by_addr)));
+        SET_LINK(LEFTP(bp, by_addr), t);
+        SET_LINK(RIGHTP(t, by_addr), NULL);
+    }
+}
+
+/*
+ * splay_join - join the two subtrees left behind by removing a root with the given key, and return
+ * the root of the result
+ */
+static void* splay_join(void* left, void* right, size_t key, int by_addr) {
+    if (left == NULL) return right;
+
+    //everything on the left is smaller, so splaying it for the key brings up its biggest node,
+    //which has no right child to lose
+    void* root = splay(left, key, by_addr);
+    SET_LINK(RIGHTP(root, by_addr), right);
+    return root;
+}
+
+/*
+ * tree_insert - add the free block bp to the size tree, as a node or on the list of its size's node
+ */
+static void tree_insert(void* bp) {
+    size_t size = GET_SIZE(HDRP(bp));
+    void* t = splay(GET_LINK(TREE_ROOTP), size, 0);
+
+    if (t != NULL && GET_SIZE(HDRP(t)) == size) {
+        //t is the node of that size, bp goes right behind it
+        void* next = GET_LINK(NEXTP(t));
+        SET_LINK(PREVP(bp), t);
+        SET_LINK(NEXTP(bp), next);
+        if (next) SET_LINK(PREVP(next), bp);
+        SET_LINK(NEXTP(t), bp);
+        SET_LINK(TREE_ROOTP, t);
+        return;
+    }
+
+    //otherwise bp becomes a node, at the root
+    SET_LINK(PREVP(bp), NULL);
+    SET_LINK(NEXTP(bp), NULL);
+    splay_root(bp, t, 0);
+    SET_LINK(TREE_ROOTP, bp);
+}
+
+/*
+ * tree_remove - take the free block bp out of the size tree
+ */
+static void tree_remove(void* bp) {
+    void* prev = GET_LINK(PREVP(bp));
+    void* next = GET_LINK(NEXTP(bp));
+    void* root;
+
+    if (prev != NULL) { //not the node, just on its list
+        SET_LINK(NEXTP(prev), next);
+        if (next) SET_LINK(PREVP(next), prev);
+        return;
+    }
+
+    size_t size = GET_SIZE(HDRP(bp));
+    splay(GET_LINK(TREE_ROOTP), size, 0); //bp is the node of its size, so this brings it to the root
+    if (next != NULL) {
+        //the next block of the same size takes over as the node
+        SET_LINK(PREVP(next), NULL);
+        SET_LINK(TREE_LEFTP(next), GET_LINK(TREE_LEFTP(bp)));
+        SET_LINK(TREE_RIGHTP(next), GET_LINK(TREE_RIGHTP(bp)));
+        root = next;
+    } else {
+        root = splay_join(GET_LINK(TREE_LEFTP(bp)), GET_LINK(TREE_RIGHTP(bp)), size, 0);
+    }
+    SET_LINK(TREE_ROOTP, root);
+}
+
+/*
+ * tree_fit - return the smallest block in the size tree of at least asize bytes, or NULL
+ */
+static void* tree_fit(size_t asize) {
+    void* t = splay(GET_LINK(TREE_ROOTP), asize, 0);
+    if (t == NULL) return NULL;
+    SET_LINK(TREE_ROOTP, t);
+
+    if (GET_SIZE(HDRP(t)) < asize) {
+        //t is the biggest node below asize, so the best fit is the smallest one right of it
+        t = GET_LINK(TREE_RIGHTP(t));
+        if (t == NULL) return NULL;
+        while (GET_LINK(TREE_LEFTP(t)) != NULL) t = GET_LINK(TREE_LEFTP(t));
+    }
+    //a block from the node's list is just as good, and cheaper to take out than the node
+    return GET_LINK(NEXTP(t)) ? GET_LINK(NEXTP(t)) : t;
+}
+
+#ifdef ADDRESS_ORDER
+/*
+ * addr_insert - add bp to the list of class in address order, with the help of the class's
+ * address tree, and to the tree itself
+ */
+static void addr_insert(void* bp, int class) {
+    //bp isn't in the tree yet, so splaying for it brings up its neighbor in the list on one side
+    void* t = splay(GET_LINK(ADDR_ROOTP(class)), (size_t)bp, 1);
+    void* prev = t;
+    void* next = t;
+    if (t == NULL) {
+        prev = next = NULL;
+    } else if (t < bp) {
+        next = GET_LINK(NEXTP(t));
+    } else {
+        prev = GET_LINK(PREVP(t));
+    }
+
+    SET_LINK(PREVP(bp), prev);
+    SET_LINK(NEXTP(bp), next);
+    if (prev) SET_LINK(NEXTP(prev), bp);
+    else SET_LINK(ROOTP(class), bp);
+    if (next) SET_LINK(PREVP(next), bp);
+
+    splay_root(bp, t, 1);
+    SET_LINK(ADDR_ROOTP(class), bp);
+}
+
+/*
+ * addr_remove - take bp out of the address tree of class. The list is fb_patching's business
+ */
+static void addr_remove(void* bp, int class) {
+    splay(GET_LINK(ADDR_ROOTP(class)), (size_t)bp, 1); //brings bp to the root
+    void* root = splay_join(GET_LINK(ADDR_LEFTP(bp)), GET_LINK(ADDR_RIGHTP(bp)), (size_t)bp, 1);
+    SET_LINK(ADDR_ROOTP(class), root);
+}
+#endif
+
+/*
+ * find_fit - given size of block we are allocating, find in the free lists to see whether
+ * there exists a free block large enough
+ */
+static void* find_fit(size_t asize) {
+    int class = get_class(asize);
+    if (class == TREE_CLASS) return tree_fit(asize);
+
+#if defined(SIDE_LISTS)
+    //the list of asize's own class may hold blocks that are too small, so scan it first-fit, newest first
+    side_entry_t* list = SIDE_LIST[HEAP_INDEX()][class];
+    for (int i = (int) SIDE_COUNT[HEAP_INDEX()][class] - 1; i >= 0; i--) {
+        if (list[i].size >= asize) return DECODE(list[i].off);
+    }
+#elif defined(NEXT_FIT)
+    //the list of asize's own class may hold blocks that are too small, so walk it next-fit: from the
+    //rover to the end, then from the head back round to the rover
+    void* start = ROVER[HEAP_INDEX()][class] ? ROVER[HEAP_INDEX()][class] : GET_LINK(ROOTP(class));
+    void* curr_free = start;
+    while (curr_free != NULL) {
+        if (GET_SIZE(HDRP(curr_free)) >= asize) {
+            ROVER[HEAP_INDEX()][class] = curr_free; //taking it out moves the rover past it
+            return curr_free;
+        }
+        curr_free = GET_LINK(NEXTP(curr_free));
+        if (curr_free == NULL) curr_free = GET_LINK(ROOTP(class));
+        if (curr_free == start) break;
+    }
+#else
+    //the list of asize's own class may hold blocks that are too small, so walk it first-fit
+    void* curr_free = GET_LINK(ROOTP(class));
+    while (curr_free != NULL) {
+        if (GET_SIZE(HDRP(curr_free)) >= asize) return curr_free;
+        curr_free = GET_LINK(NEXTP(curr_free));
+    }
+#endif
+
+    //every block in a bigger class is large enough, so the first non-empty list's head does the job.
+    //mask off the classes up to and including ours, then the lowest set bit is that list
+    unsigned int bigger = READ(BITMAPP) & (~0u << (class + 1));
+    if (bigger == 0) return NULL;
+    class = __builtin_ctz(bigger);
+    if (class == TREE_CLASS) return tree_fit(asize); //every block in the tree fits, tree_fit finds the smallest
+#ifdef SIDE_LISTS
+    return DECODE(SIDE_LIST[HEAP_INDEX()][class][SIDE_COUNT[HEAP_INDEX()][class] - 1].off);
+#else
+    return GET_LINK(ROOTP(class));
+#endif
+}
+
+/*
+ * get_class - hash a block size to the index of the free list it belongs in
+ */
+static int get_class(size_t size) {
+    if (size <= MIN_BLOCK_SIZE) return 0;
+
+    //class i holds (2^(i+3), 2^(i+4)], so it's floor(log2(size - 1)) - 3
+    int class = (8*sizeof(unsigned long) - 1) - __builtin_clzl(size - 1) - 3;
+    return class < NUM_CLASSES ? class : NUM_CLASSES - 1;
+}
+
+/*
+ * set_class_bit/clear_class_bit - mark a class's list as non-empty/empty in the bitmap
+ */
+static void set_class_bit(int class) {
+    WRITE(BITMAPP, READ(BITMAPP) | (1u << class));
+}
+
+static void clear_class_bit(int class) {
+    WRITE(BITMAPP, READ(BITMAPP) & ~(1u << class));
+}
+#endif
+
+#ifndef BUDDY
+/*
+ * handle_malloc - handle the allocation of a block with size asize at address bp
+ */
+static void handle_malloc(void* bp, size_t asize) {
+    size_t cf_size = GET_SIZE(HDRP(bp)); //get size of current free block
+    size_t rem_size = cf_size - asize; //get remaining size after the block is allocated
+
+    fb_patching(bp); //see explanation of what this does in the comment for the function.
+
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp));
+    size_t purged = IS_PURGED(HDRP(bp)); //the remainder is inside the purged pages, so it stays purged
+    if (rem_size < MIN_BLOCK_SIZE) { //if the remainder is not enough to construct a free block, just return the whole block
+        //mark off malloc block with header information, and tell the next block about it
+        WRITE(HDRP(bp), PACK(cf_size, prev_alloc, 1));
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+    } else { //otherwise, create a new free block from the remainder
+        //mark off malloc block
+        WRITE(HDRP(bp), PACK(asize, prev_alloc, 1));
+
+        //construct new free block. The block after it already knows its prev is free
+        void* new_free = NEXT_BLKP(bp);
+        WRITE(HDRP(new_free), PACK(rem_size, 1, 0) | purged);
+        WRITE(FTRP(new_free), PACK(rem_size, 0, 0));
+
+        //add new free block to the list of its class
+        add_free(new_free);
+    }
+}
+#endif
+
+/*
+ * mm_free - Freeing a block.
+ * input is a pointer to a previously malloc'd block
+ */
+void mm_free(void *bp) {
+    if (bp == NULL) return;
+
+    int slab = slab_object(bp);
+#ifdef TCACHE
+    if (slab) {
+        tcache_free(bp);
+        return;
+    }
+#endif
+    if (!slab && IS_MAPPED(HDRP(bp))) {
+        munmap_block(bp);
+        return;
+    }
+#ifdef THREADS
+    arena_t* owner = owner_arena(bp);
+    if (owner != my_arena()) {
+        remote_free(owner, bp); //not ours, so don't hold up the threads working on that arena
+        return;
+    }
+#endif
+    LOCK_ARENA(owner_arena(bp));
+    release_block(bp);
+    UNLOCK_ARENA();
+}
+
+/*
+ * release_block - give anything handed out by heap_malloc back to the current heap
+ */
+static void release_block(void* bp) {
+    size_t size;
+    if (slab_object(bp)) {
+        slab_free(bp);
+    } else if (IS_FAST_SIZE(size = GET_SIZE(HDRP(bp)))) {
+        SET_LINK(NEXTP(bp), GET_LINK(FAST_ROOTP(size)));
+        SET_LINK(FAST_ROOTP(size), bp);
+        FAST_BLOCKS[HEAP_INDEX()]++;
+    } else {
+#ifdef DEFER_COALESCE
+        SET_LINK(NEXTP(bp), GET_LINK(UNSORTED_ROOTP));
+        SET_LINK(UNSORTED_ROOTP, bp);
+        UNSORTED_BYTES[HEAP_INDEX()] += size;
+        if (UNSORTED_BYTES[HEAP_INDEX()] > UNSORTED_MAX) consolidate_bins(0);
+#else
+        free_block(bp);
+#endif
+    }
+}
+
+/*
+ * free_bin - coalesce_block every block on the bin at rootp, and leave the bin empty
+ */
+static void free_bin(void* rootp, int purge) {
+    void* bp = GET_LINK(rootp);
+    SET_LINK(rootp, NULL);
+    while (bp != NULL) {
+        void* next = GET_LINK(NEXTP(bp));
+        coalesce_block(bp, purge);
+        bp = next;
+    }
+}
+
+/*
+ * consolidate_bins - empty every fast bin of the current heap, and the unsorted bin if there is one,
+ * into the free lists, coalescing as usual and purging as well if purge is set. Returns whether there
+ * was anything to empty.
+ */
+static int consolidate_bins(int purge) {
+    int heap = HEAP_INDEX();
+#ifdef DEFER_COALESCE
+    int unsorted = UNSORTED_BYTES[heap] != 0;
+    if (unsorted) {
+        UNSORTED_BYTES[heap] = 0;
+        free_bin(UNSORTED_ROOTP, purge);
+    }
+    if (FAST_BLOCKS[heap] == 0) return unsorted;
+#else
+    if (FAST_BLOCKS[heap] == 0) return 0;
+#endif
+
+    for (size_t size = FAST_MIN_SIZE; size <= FAST_MAX_SIZE; size += DSIZE) {
+        free_bin(FAST_ROOTP(size), purge);
+    }
+    FAST_BLOCKS[heap] = 0;
+    return 1;
+}
+
+/*
+ * free_block - give a boundary-tagged block back to the heap
+ */
+static void free_block(void* bp) {
+    coalesce_block(bp, 1);
+}
+
+#ifndef BUDDY
+/*
+ * coalesce_block - what free_block does, except the big free block that comes out of it only gets
+ * purged if purge is set. Leaving it be makes sense when it's about to be allocated again anyway.
+ */
+static void coalesce_block(void* bp, int purge) {
+    size_t size = GET_SIZE(HDRP(bp)); //get size of block to be freed
+#ifndef PURGE_DECAY
+    void* freed = bp;
+
+    //whether coalescing is about to pull in pages that were never purged
+    int prev_dirty = !GET_PREV_ALLOC(HDRP(bp)) && !IS_PURGED(HDRP(PREV_BLKP(bp)));
+    int next_dirty = !GET_ALLOC(HDRP(NEXT_BLKP(bp))) && !IS_PURGED(HDRP(NEXT_BLKP(bp)));
+#endif
+
+    WRITE(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp)), 0)); //set alloc bit to 0
+    WRITE(FTRP(bp), PACK(size, 0, 0)); //free blocks need their footer back
+    bp = handle_free(bp); //handle coalescing, basically
+
+    //enough free space at the end of the heap: give most of it back
+    if (GET_SIZE(HDRP(bp)) >= TRIM_THRESHOLD && GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0) trim_heap(TRIM_PAD);
+
+#ifndef PURGE_DECAY
+    //purge big free blocks. Purged neighbors only need the pages their old boundary tags and links were on
+    size_t new_size = GET_SIZE(HDRP(bp));
+    if (purge && new_size >= PURGE_THRESHOLD) {
+        void* lo = (bp == freed || prev_dirty) ? bp : freed - DSIZE;
+        void* hi = (bp + new_size == freed + size || next_dirty) ? bp + new_size : freed + size + FREE_LINKS_SIZE;
+        purge_pages(bp, lo, hi);
+        WRITE(HDRP(bp), READ(HDRP(bp)) | PURGED);
+    }
+#else
+    (void) purge; //the purging thread takes care of it
+#endif
+}
+#endif
+
+/*
+ * purge_pages - hand the whole pages of the free block bp that overlap lo..hi back to the OS.
+ * The pages holding the header, the links and the footer stay, since the free lists need them.
+ * With -DHUGE_PAGES these are whole huge pages, so purging never splits one.
+ */
+static void purge_pages(void* bp, void* lo, void* hi) {
+    void* start = MAX(PURGE_UP(bp + FREE_LINKS_SIZE), PURGE_DOWN(lo)); //first whole page past the link words
+    void* end = PURGE_DOWN(FTRP(bp)) < PURGE_UP(hi) ? PURGE_DOWN(FTRP(bp)) : PURGE_UP(hi);
+    if (start >= end) return;
+
+    madvise(start, end - start, MADV_DONTNEED);
+    PURGE_COUNT[HEAP_INDEX()]++;
+    PURGE_BYTES[HEAP_INDEX()] += end - start;
+}
+
+/*
+ * mm_purge_stats - report what purging has done on every heap since mm_init: how many madvise calls
+ * it took, how many bytes they covered, and how many bytes of free blocks still wait to be purged
+ * (always 0 unless built with -DPURGE_DECAY). Any of the pointers may be NULL.
+ */
+void mm_purge_stats(unsigned long* purges, unsigned long* purged_bytes, unsigned long* dirty_bytes) {
+    unsigned long count = 0, bytes = 0, dirty = 0;
+
+    for (int i = 0; i < NUM_HEAPS; i++) {
+#ifdef THREADS
+        LOCK_ARENA(&ARENAS[i]);
+#endif
+        count += PURGE_COUNT[i];
+        bytes += PURGE_BYTES[i];
+#ifdef PURGE_DECAY
+        dirty += DIRTY_BYTES[i];
+#endif
+        UNLOCK_ARENA();
+    }
+    if (purges) *purges = count;
+    if (purged_bytes) *purged_bytes = bytes;
+    if (dirty_bytes) *dirty_bytes = dirty;
+}
+
+#ifndef BUDDY
+/*
+ * handle_free - handle coalescing and correct linking of free blocks
+ * Since no two free blocks are ever left next to each other, whatever comes before a coalesced
+ * block is allocated, and whatever comes after it gets told that its prev is now free.
+ */
+static void* handle_free(void* bp) {
+    size_t prev_alloc = GET_PREV_ALLOC(HDRP(bp)); //get whether the prev/next block are free
+    void* prev_block = prev_alloc ? NULL : PREV_BLKP(bp); //prev only has a footer to find it by if it's free
+    void* next_block = NEXT_BLKP(bp);
+    size_t next_alloc = GET_ALLOC(HDRP(next_block));
+    size_t size = GET_SIZE(HDRP(bp)); //get size of current block
+
+    if (prev_alloc && next_alloc) { //case 1: both prev/next blocks are alloc'd
+        //do nothing
+    }
+
+    else if (prev_alloc && !next_alloc) { //case 2: prev alloc'd next free
+        fb_patching(next_block);
+
+        //coalescing next block and new block, updating new block's size
+        size += GET_SIZE(HDRP(next_block));
+        WRITE(HDRP(bp), PACK(size, 1, 0));
+        WRITE(FTRP(next_block), PACK(size, 0, 0));
+    }
+
+    else if (!prev_alloc && next_alloc) { //case 3: prev free next alloc'd
+        fb_patching(prev_block);
+
+        //coalescing prev block and new block, updating new block's size
+        size += GET_SIZE(HDRP(prev_block));
+        WRITE(HDRP(prev_block), PACK(size, 1, 0));
+        WRITE(FTRP(bp), PACK(size, 0, 0));
+        bp = prev_block;
+    }
+
+    else { //case 4: both free
+        //cut off both prev/next blocks
+        fb_patching(prev_block);
+        fb_patching(next_block);
+
+        //coalescing
+        size = size + GET_SIZE(HDRP(prev_block)) + GET_SIZE(HDRP(next_block));
+        WRITE(HDRP(prev_block), PACK(size, 1, 0));
+        WRITE(FTRP(next_block), PACK(size, 0, 0));
+        bp = prev_block;
+    }
+
+    CLEAR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+
+    //add free block to beginning of the list of its class
+    add_free(bp);
+
+    return bp;
+}
+#endif
+
+/*
+ * add_free - add bp to beginning of the free list of its size class
+ */
+static void add_free(void* bp) {
+    int class = get_class(GET_SIZE(HDRP(bp)));
+    set_class_bit(class); //the list is non-empty now
+#ifdef PURGE_DECAY
+    if (IS_DIRTY(HDRP(bp))) dirty_link(bp);
+#endif
+#if !defined(TLSF) && !defined(BUDDY)
+    if (class == TREE_CLASS) {
+        tree_insert(bp);
+        return;
+    }
+#endif
+#ifdef ADDRESS_ORDER
+    if (class > 0) { //every block of class 0 is 16 bytes, too small for tree links, and just as good as any other
+        addr_insert(bp, class);
+        return;
+    }
+#endif
+#ifdef SIDE_LISTS
+    side_push(bp, class);
+    return;
+#endif
+
+    void* rootp = ROOTP(class);
+    void* old_root = GET_LINK(rootp);
+    SET_LINK(PREVP(bp), NULL); //set previous pointer to NULL (since we're adding it at root)
+    //bp's next is the old root, which is NULL anyway if the list was empty
+    SET_LINK(NEXTP(bp), old_root);
+    if (old_root) SET_LINK(PREVP(old_root), bp);
+    SET_LINK(rootp, bp);
+}
+
+/*
+ * fb_patching - Patch the previous/next free blocks of bp together
+ * Also update the root of bp's class to point at next free block from bp if bp is already root
+ * Essentially, it's an utility for removing bp from the free list.
+ * Must be called before bp's header is resized, since the header decides which list it is in.
+ */
+static void fb_patching(void* bp) {
+    int class = get_class(GET_SIZE(HDRP(bp)));
+#ifdef PURGE_DECAY
+    if (IS_DIRTY(HDRP(bp))) dirty_unlink(bp);
+#endif
+#if !defined(TLSF) && !defined(BUDDY)
+    if (class == TREE_CLASS) {
+        tree_remove(bp);
+        if (GET_LINK(TREE_ROOTP) == NULL) clear_class_bit(TREE_CLASS);
+        return;
+    }
+#endif
+#ifdef ADDRESS_ORDER
+    if (class > 0) addr_remove(bp, class); //and then out of the list as usual
+#endif
+#ifdef SIDE_LISTS
+    side_remove(bp, class);
+    return;
+#endif
+
+    //getting the relevant blocks for pointer reallocating
+    void* bp_prev = GET_LINK(PREVP(bp));
+    void* bp_next = GET_LINK(NEXTP(bp));
+
+    //rearranging prev next for prev block prev/next
+    if (bp_prev) {
+        SET_LINK(NEXTP(bp_prev), bp_next);
+    }
+    else {
+        SET_LINK(ROOTP(class), bp_next);
+        if (!bp_next) clear_class_bit(class); //bp was the only block of its class
+    }
+    if (bp_next) SET_LINK(PREVP(bp_next), bp_prev);
+#ifdef NEXT_FIT
+    if (ROVER[HEAP_INDEX()][class] == bp) ROVER[HEAP_INDEX()][class] = bp_next;
+#endif
+}
+
+#ifdef SIDE_LISTS
+/*
+ * side_push - append bp to the side array of its class, doubling the array first if it's full.
+ * If that fails, bp stays off the list (SIDE_UNLISTED) until it coalesces with a neighbor.
+ */
+static void side_push(void* bp, int class) {
+    int heap = HEAP_INDEX();
+    unsigned int n = SIDE_COUNT[heap][class];
+
+    if (n == SIDE_CAP[heap][class]) {
+        size_t cap = n ? 2*n : SIDE_MIN_ENTRIES;
+        void* list = n ? mremap(SIDE_LIST[heap][class], n*sizeof(side_entry_t), cap*sizeof(side_entry_t), MREMAP_MAYMOVE)
+                       : mmap(NULL, cap*sizeof(side_entry_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (list == MAP_FAILED) {
+            WRITE(SIDE_INDEXP(bp), SIDE_UNLISTED);
+            if (n == 0) clear_class_bit(class); //add_free already set it
+            return;
+        }
+        SIDE_LIST[heap][class] = list;
+        SIDE_CAP[heap][class] = cap;
+    }
+
+    SIDE_LIST[heap][class][n].size = GET_SIZE(HDRP(bp));
+    SIDE_LIST[heap][class][n].off = ENCODE(bp);
+    WRITE(SIDE_INDEXP(bp), n);
+    SIDE_COUNT[heap][class] = n + 1;
+}
+
+/*
+ * side_remove - take bp out of the side array of its class, moving the last entry into its slot
+ */
+static void side_remove(void* bp, int class) {
+    int heap = HEAP_INDEX();
+    unsigned int i = READ(SIDE_INDEXP(bp));
+    if (i == SIDE_UNLISTED) return;
+
+    side_entry_t* list = SIDE_LIST[heap][class];
+    unsigned int last = --SIDE_COUNT[heap][class];
+    if (i != last) {
+        list[i] = list[last];
+        WRITE(SIDE_INDEXP(DECODE(list[i].off)), i);
+    }
+    if (last == 0) clear_class_bit(class); //bp was the only block of its class
+}
+#endif
+
+/*
+ * mm_realloc - Resize a previously malloc'd block, in place whenever the neighbors allow it.
+ * In order of preference:
+ * 1. shrinking (or same size): cut off the tail and free it
+ * 2. growing into the next block if it's free, pulling more memory from the heap first
+ *    if the block (plus that free neighbor) is the last one before the epilogue
+ * 3. growing into the previous block if it's free (plus the next one), sliding the data down
+ * 4. otherwise, the usual malloc + copy + free
+ */
+void* mm_realloc(void *ptr, size_t size) {
+    if (ptr == NULL) return mm_malloc(size);
+    if (size == 0) {
+        mm_free(ptr);
+        return NULL;
+    }
+
+    //slab objects can't grow in place, and shrinking them means moving to another class's page
+    if (slab_object(ptr)) {
+        size_t old_size = READ(SLAB_SIZEP(SLAB_PAGEP(ptr)));
+        if (size <= old_size) return ptr;
+
+        void* new_ptr = mm_malloc(size);
+        if (new_ptr == NULL) return NULL;
+        memcpy(new_ptr, ptr, old_size);
+        mm_free(ptr);
+        return new_ptr;
+    }
+
+    if (IS_MAPPED(HDRP(ptr))) return mremap_block(ptr, size);
+
+    //a heap block growing past the threshold moves out to a mapping, so the next growth is a mremap
+    size_t old_size = GET_SIZE(HDRP(ptr));
+    if (size >= MMAP_THRESHOLD && adjust_size(size) > old_size) {
+        void* new_ptr = mmap_block(size);
+        if (new_ptr == NULL) return NULL;
+        memcpy(new_ptr, ptr, old_size - WSIZE);
+        mm_free(ptr);
+        return new_ptr;
+    }
+
+    LOCK_ARENA(owner_arena(ptr));
+    void* new_ptr = realloc_block(ptr, adjust_size(size));
+    UNLOCK_ARENA();
+
+#ifdef THREADS
+    //the block's arena is full, but mm_malloc can still fall back to the main heap
+    if (new_ptr == NULL) {
+        new_ptr = mm_malloc(size);
+        if (new_ptr == NULL) return NULL;
+        memcpy(new_ptr, ptr, old_size - WSIZE);
+        mm_free(ptr);
+    }
+#endif
+    return new_ptr;
+}
+
+#ifndef BUDDY
+/*
+ * realloc_block - the body of mm_realloc, resizing ptr to a block of asize bytes (already adjusted)
+ */
+static void* realloc_block(void* ptr, size_t asize) {
+    size_t old_size = GET_SIZE(HDRP(ptr));
+
+    //case 1: the block is already big enough
+    if (asize <= old_size) {
+        shrink_block(ptr, asize);
+        return ptr;
+    }
+
+    //how much room we have if we take the next block too
+    void* next_block = NEXT_BLKP(ptr);
+    size_t next_free = !GET_ALLOC(HDRP(next_block));
+    size_t avail = old_size + (next_free ? GET_SIZE(HDRP(next_block)) : 0);
+
+    //if we are at the end of the heap, just ask for what's missing instead of moving.
+    //If the heap can't grow, the cases below may still find room
+    void* after = next_free ? NEXT_BLKP(next_block) : next_block;
+    if (avail < asize && GET_SIZE(HDRP(after)) == 0 && extend_heap(MAX(asize - avail, DEFAULT_CHUNKSIZE)/WSIZE) != NULL) {
+        next_block = NEXT_BLKP(ptr); //extension got coalesced with the free neighbor, if any
+        next_free = 1;
+        avail = old_size + GET_SIZE(HDRP(next_block));
+    }
+
+    //case 2: absorb the next block
+    if (avail >= asize) {
+        if (next_free) {
+            fb_patching(next_block);
+            WRITE(HDRP(ptr), PACK(avail, GET_PREV_ALLOC(HDRP(ptr)), 1));
+            SET_PREV_ALLOC(HDRP(NEXT_BLKP(ptr)));
+        }
+        shrink_block(ptr, asize);
+        return ptr;
+    }
+
+    //case 3: absorb the previous block (and the next block if it's free), moving the data down
+    void* prev_block = GET_PREV_ALLOC(HDRP(ptr)) ? NULL : PREV_BLKP(ptr);
+    if (prev_block != NULL && GET_SIZE(HDRP(prev_block)) + avail >= asize) {
+        avail += GET_SIZE(HDRP(prev_block));
+        //unlink before memmove, since the data may overwrite the link words
+        fb_patching(prev_block);
+        if (next_free) fb_patching(next_block);
+
+        memmove(prev_block, ptr, old_size - WSIZE); //payload is everything but the header
+        WRITE(HDRP(prev_block), PACK(avail, 1, 1)); //prev of a free block is always allocated
+        SET_PREV_ALLOC(HDRP(NEXT_BLKP(prev_block)));
+        shrink_block(prev_block, asize);
+        return prev_block;
+    }
+
+    //case 4: no way around copying
+    void* new_ptr = malloc_block(asize);
+    if (new_ptr == NULL) return NULL;
+    memcpy(new_ptr, ptr, old_size - WSIZE);
+    free_block(ptr);
+    return new_ptr;
+}
+
+/*
+ * shrink_block - cut an allocated block at bp down to asize, freeing the remainder
+ * if it's big enough to form a free block on its own
+ */
+static void shrink_block(void* bp, size_t asize) {
+    size_t size = GET_SIZE(HDRP(bp));
+    if (size - asize < MIN_BLOCK_SIZE) return; //remainder too small, keep the whole block
+
+    WRITE(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp)), 1));
+
+    void* tail = NEXT_BLKP(bp);
+    WRITE(HDRP(tail), PACK(size - asize, 1, 0));
+    WRITE(FTRP(tail), PACK(size - asize, 0, 0));
+    handle_free(tail); //coalesce with the next block if it's free
+}
+#endif
+
+/*
+ * mmap_block - allocate a block in a mapping of its own, which goes straight back to the OS on free.
+ * Only for requests of at least MMAP_THRESHOLD bytes, so the wasted page tail and the syscalls
+ * are small next to the request itself.
+ */
+static void* mmap_block(size_t size) {
+    if (size > SIZE_MAX - MAPPED_HDR_SIZE - OS_PAGE_SIZE) return NULL; //the length would wrap around
+    size_t len = (size + MAPPED_HDR_SIZE + OS_PAGE_SIZE - 1) & ~(size_t)(OS_PAGE_SIZE - 1);
+    void* region = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) return NULL;
+
+    void* bp = region + MAPPED_HDR_SIZE;
+    *MAPPED_LENP(bp) = len;
+    WRITE(HDRP(bp), PACK(MAPPED, 1, 1)); //size is in MAPPED_LENP, it may not fit in a header
+    return bp;
+}
+
+/*
+ * munmap_block - give a mapped block back to the OS
+ */
+static void munmap_block(void* bp) {
+    munmap(bp - MAPPED_HDR_SIZE, *MAPPED_LENP(bp));
+}
+
+/*
+ * mremap_block - resize a mapped block. The kernel moves the pages instead of us copying them,
+ * and a block shrinking below MMAP_THRESHOLD moves back into the heap
+ */
+static void* mremap_block(void* bp, size_t size) {
+    size_t old_len = *MAPPED_LENP(bp);
+
+    if (size < MMAP_THRESHOLD) {
+        void* new_ptr = mm_malloc(size);
+        if (new_ptr == NULL) return NULL;
+        memcpy(new_ptr, bp, size);
+        munmap_block(bp);
+        return new_ptr;
+    }
+
+    if (size > SIZE_MAX - MAPPED_HDR_SIZE - OS_PAGE_SIZE) return NULL; //the length would wrap around
+    size_t len = (size + MAPPED_HDR_SIZE + OS_PAGE_SIZE - 1) & ~(size_t)(OS_PAGE_SIZE - 1);
+    if (len == old_len) return bp;
+
+    void* region = mremap(bp - MAPPED_HDR_SIZE, old_len, len, MREMAP_MAYMOVE);
+    if (region == MAP_FAILED) return NULL;
+
+    bp = region + MAPPED_HDR_SIZE;
+    *MAPPED_LENP(bp) = len;
+    return bp;
+}
+
+#ifndef BUDDY
+/*
+ * malloc_aligned_block - allocate a block of asize bytes whose payload starts on an align boundary.
+ * A plain fit often lands on one already (the hole a freed slab page left, for example). If not,
+ * we ask for enough extra room to slide forward to the boundary while leaving a valid free
+ * block in front, then give the front and the tail back.
+ */
+static void* malloc_aligned_block(size_t asize, size_t align) {
+    void* bp = malloc_block(asize);
+    if (bp == NULL) return NULL;
+    if (((unsigned long) bp & (align - 1)) == 0) return bp;
+    free_block(bp);
+
+    bp = malloc_block(asize + align + MIN_BLOCK_SIZE);
+    if (bp == NULL) return NULL;
+    if (((unsigned long) bp & (align - 1)) == 0) { //already on the boundary, only the tail is extra
+        shrink_block(bp, asize);
+        return bp;
+    }
+
+    void* aligned = (void*)(((unsigned long) bp + MIN_BLOCK_SIZE + align - 1) & ~(unsigned long)(align - 1));
+    size_t front = aligned - bp;
+    size_t size = GET_SIZE(HDRP(bp));
+
+    WRITE(HDRP(aligned), PACK(size - front, 0, 1)); //the front is about to be freed
+    WRITE(HDRP(bp), PACK(front, GET_PREV_ALLOC(HDRP(bp)), 0));
+    WRITE(FTRP(bp), PACK(front, 0, 0));
+    handle_free(bp);
+
+    shrink_block(aligned, asize);
+    return aligned;
+}
+#endif
+
+/*
+ * slab_object - whether bp was handed out by a slab page rather than being a boundary-tagged block
+ */
+static int slab_object(void* bp) {
+#ifdef THREADS
+    arena_t* arena = owner_arena(bp); //FREE_LISTS may be some other arena's heap right now
+    int heap = arena - ARENAS;
+    void* start = arena->heap;
+#else
+    int heap = 0;
+    void* start = FREE_LISTS;
+#endif
+    if (bp < start) return 0;
+    unsigned long page = (unsigned long)(bp - SLAB_PAGEP(start)) >> SLAB_PAGE_SHIFT;
+    if (page >= SLAB_MAP_TOP[heap]) return 0;
+    return (SLAB_MAP[heap][page/32] >> (page%32)) & 1;
+}
+
+/*
+ * set_slab_page - mark a page of the current heap as a slab page or not in the slab map
+ */
+static void set_slab_page(void* page, int is_slab) {
+    int heap = HEAP_INDEX();
+    unsigned long i = (unsigned long)(page - SLAB_PAGEP(FREE_LISTS)) >> SLAB_PAGE_SHIFT;
+
+    if (is_slab) {
+        SLAB_MAP[heap][i/32] |= 1u << (i%32);
+        if (i >= SLAB_MAP_TOP[heap]) SLAB_MAP_TOP[heap] = i + 1;
+    } else {
+        SLAB_MAP[heap][i/32] &= ~(1u << (i%32));
+    }
+}
+
+/*
+ * slab_link/slab_unlink - add a slab page to/remove it from the list of pages of its class that
+ * still have room. Same idea as add_free/fb_patching
+ */
+static void slab_link(void* page, int class) {
+    void* old_root = GET_LINK(SLAB_ROOTP(class));
+
+    SET_LINK(SLAB_PREVP(page), NULL);
+    SET_LINK(SLAB_NEXTP(page), old_root);
+    if (old_root) SET_LINK(SLAB_PREVP(old_root), page);
+    SET_LINK(SLAB_ROOTP(class), page);
+}
+
+static void slab_unlink(void* page, int class) {
+    void* prev = GET_LINK(SLAB_PREVP(page));
+    void* next = GET_LINK(SLAB_NEXTP(page));
+
+    if (prev) {
+        SET_LINK(SLAB_NEXTP(prev), next);
+    } else {
+        SET_LINK(SLAB_ROOTP(class), next);
+    }
+    if (next) SET_LINK(SLAB_PREVP(next), prev);
+}
+
+/*
+ * slab_full - whether a slab page has no object left to hand out
+ */
+static int slab_full(void* page) {
+    return READ(SLAB_FREEP(page)) == 0 && READ(SLAB_BUMPP(page)) + READ(SLAB_SIZEP(page)) > SLAB_END;
+}
+
+/*
+ * slab_malloc - hand out an object of the given slab class from the current heap, carving a new
+ * slab page out of the heap if no page of the class has room
+ */
+static void* slab_malloc(int class) {
+    void* page = GET_LINK(SLAB_ROOTP(class));
+
+    if (page == NULL) {
+        page = malloc_aligned_block(adjust_size(SLAB_END), SLAB_PAGE_SIZE); //pages can sit back to back
+        if (page == NULL) return NULL;
+
+        WRITE(SLAB_SIZEP(page), SLAB_CLASS_SIZE(class));
+        WRITE(SLAB_USEDP(page), 0);
+        WRITE(SLAB_FREEP(page), 0);
+        WRITE(SLAB_BUMPP(page), SLAB_HDR_SIZE); //objects are only carved out as they are needed
+        set_slab_page(page, 1);
+        slab_link(page, class);
+    }
+
+    //reuse a freed object if there is one, otherwise carve out the next fresh one
+    void* bp;
+    unsigned int free_offset = READ(SLAB_FREEP(page));
+    if (free_offset) {
+        bp = page + free_offset;
+        WRITE(SLAB_FREEP(page), READ(bp));
+    } else {
+        bp = page + READ(SLAB_BUMPP(page));
+        WRITE(SLAB_BUMPP(page), READ(SLAB_BUMPP(page)) + READ(SLAB_SIZEP(page)));
+    }
+    WRITE(SLAB_USEDP(page), READ(SLAB_USEDP(page)) + 1);
+
+    if (slab_full(page)) slab_unlink(page, class); //nothing left here for the next caller
+    return bp;
+}
+
+/*
+ * slab_free - give a slab object back to its page. A page that ends up empty goes back to the
+ * heap, unless it's the only page of its class with room left
+ */
+static void slab_free(void* bp) {
+    void* page = SLAB_PAGEP(bp);
+    int class = SLAB_CLASS(READ(SLAB_SIZEP(page)));
+
+    if (slab_full(page)) slab_link(page, class); //it has room again
+
+    WRITE(bp, READ(SLAB_FREEP(page)));
+    WRITE(SLAB_FREEP(page), bp - page);
+    WRITE(SLAB_USEDP(page), READ(SLAB_USEDP(page)) - 1);
+
+    if (READ(SLAB_USEDP(page)) == 0 && (GET_LINK(SLAB_ROOTP(class)) != page || GET_LINK(SLAB_NEXTP(page)) != NULL)) {
+        slab_unlink(page, class);
+        set_slab_page(page, 0);
+        free_block(page);
+    }
+}
+
+#ifdef THREADS
+/*
+ * my_arena - the arena the calling thread allocates from. Threads are assigned round-robin
+ * the first time they allocate
+ */
+static arena_t* my_arena(void) {
+    if (MY_ARENA == NULL) {
+        MY_ARENA = &ARENAS[__sync_fetch_and_add(&NEXT_ARENA, 1) % NUM_ARENAS];
+    }
+    return MY_ARENA;
+}
+
+/*
+ * owner_arena - the arena a block belongs to, which is not necessarily the caller's.
+ * Everything inside the arena reservation belongs to the arena whose slice it falls in,
+ * everything else came from the main heap
+ */
+static arena_t* owner_arena(void* bp) {
+    if (bp >= ARENA_REGION && bp < ARENA_REGION + (NUM_ARENAS - 1)*ARENA_SIZE) {
+        return &ARENAS[1 + (bp - ARENA_REGION)/ARENA_SIZE];
+    }
+    return &ARENAS[0];
+}
+
+/*
+ * lock_arena - take an arena's lock and point FREE_LISTS at its heap
+ */
+static void lock_arena(arena_t* arena) {
+    pthread_mutex_lock(&arena->lock);
+    CUR_ARENA = arena;
+    FREE_LISTS = arena->heap;
+}
+
+/*
+ * remote_free - push bp onto the remote free stack of the arena it belongs to. Lock-free, and
+ * safe from ABA since blocks are only ever taken off by swapping out the whole stack at once
+ */
+static void remote_free(arena_t* arena, void* bp) {
+    void* top = __atomic_load_n(&arena->remote_frees, __ATOMIC_RELAXED);
+    do {
+        REMOTE_NEXT(bp) = top;
+    } while (!__atomic_compare_exchange_n(&arena->remote_frees, &top, bp, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+}
+
+/*
+ * drain_remote_frees - free every block on the remote free stack of the locked arena,
+ * coalescing them into its free lists
+ */
+static void drain_remote_frees(void) {
+    if (__atomic_load_n(&CUR_ARENA->remote_frees, __ATOMIC_RELAXED) == NULL) return;
+
+    void* bp = __atomic_exchange_n(&CUR_ARENA->remote_frees, NULL, __ATOMIC_ACQUIRE);
+    while (bp != NULL) {
+        void* next = REMOTE_NEXT(bp);
+        release_block(bp);
+        bp = next;
+    }
+}
+#endif
+
+#ifdef PURGE_DECAY
+/*
+ * dirty_link/dirty_unlink - add a free block to the head of the dirty list, or take it off
+ */
+static void dirty_link(void* bp) {
+    void* old_head = GET_LINK(DIRTY_HEADP);
+
+    SET_LINK(DIRTY_PREVP(bp), NULL);
+    SET_LINK(DIRTY_NEXTP(bp), old_head);
+    if (old_head) {
+        SET_LINK(DIRTY_PREVP(old_head), bp);
+    } else {
+        SET_LINK(DIRTY_TAILP, bp);
+    }
+    SET_LINK(DIRTY_HEADP, bp);
+    DIRTY_BYTES[HEAP_INDEX()] += GET_SIZE(HDRP(bp));
+}
+
+static void dirty_unlink(void* bp) {
+    void* prev = GET_LINK(DIRTY_PREVP(bp));
+    void* next = GET_LINK(DIRTY_NEXTP(bp));
+
+    if (prev) {
+        SET_LINK(DIRTY_NEXTP(prev), next);
+    } else {
+        SET_LINK(DIRTY_HEADP, next);
+    }
+    if (next) {
+        SET_LINK(DIRTY_PREVP(next), prev);
+    } else {
+        SET_LINK(DIRTY_TAILP, prev);
+    }
+    DIRTY_BYTES[HEAP_INDEX()] -= GET_SIZE(HDRP(bp));
+}
+
+/*
+ * decay_target - close the current epoch of the locked arena and work out how many dirty bytes it
+ * may keep: everything dirtied in the last DECAY_TIME_MS, weighted by how recently it happened
+ */
+static size_t decay_target(void) {
+    int heap = HEAP_INDEX();
+    size_t dirty = DIRTY_BYTES[heap];
+
+    for (int i = DECAY_EPOCHS - 1; i > 0; i--) {
+        DECAY_NEW[heap][i] = DECAY_NEW[heap][i - 1];
+    }
+    DECAY_NEW[heap][0] = dirty > DECAY_LAST[heap] ? dirty - DECAY_LAST[heap] : 0;
+
+    size_t target = 0;
+    for (int i = 0; i < DECAY_EPOCHS; i++) {
+        target += DECAY_NEW[heap][i]/DECAY_EPOCHS*(DECAY_EPOCHS - i);
+    }
+    return target;
+}
+
+/*
+ * decay_arena - purge the oldest dirty blocks of an arena until it's within its decay target.
+ * The lock is dropped between blocks, so the arena's threads only ever wait for one madvise.
+ */
+static void decay_arena(arena_t* arena) {
+    LOCK_ARENA(arena);
+    size_t target = decay_target();
+
+    while (DIRTY_BYTES[HEAP_INDEX()] > target) {
+        void* bp = GET_LINK(DIRTY_TAILP);
+        dirty_unlink(bp);
+        purge_pages(bp, bp, bp + GET_SIZE(HDRP(bp)));
+        WRITE(HDRP(bp), READ(HDRP(bp)) | PURGED); //it stays on its free list
+
+        UNLOCK_ARENA();
+        LOCK_ARENA(arena);
+    }
+    DECAY_LAST[HEAP_INDEX()] = DIRTY_BYTES[HEAP_INDEX()];
+    UNLOCK_ARENA();
+}
+
+/*
+ * decay_thread - the background purging thread, going over every arena once per epoch
+ */
+static void* decay_thread(void* unused) {
+    (void) unused; //pthread_create's argument, which it has no use for
+    struct timespec epoch = {0, DECAY_TIME_MS/DECAY_EPOCHS*1000000L};
+
+    for (;;) {
+        nanosleep(&epoch, NULL);
+        for (int i = 0; i < NUM_ARENAS; i++) {
+            decay_arena(&ARENAS[i]);
+        }
+    }
+    return NULL;
+}
+
+static void decay_start(void) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, decay_thread, NULL) == 0) pthread_detach(thread);
+}
+#endif
+
+#ifdef TCACHE
+/*
+ * tcache_release - give count objects from bin i back to the arenas they came from. Objects of our
+ * own arena are freed under a single lock acquisition, the others go onto their remote free stacks
+ */
+static void tcache_release(int i, int count) {
+    int locked = 0;
+
+    for (int n = 0; n < count; n++) {
+        void* bp = TCACHE_BIN[i];
+        TCACHE_BIN[i] = TCACHE_NEXT(bp);
+
+        arena_t* owner = owner_arena(bp);
+        if (owner != my_arena()) {
+            remote_free(owner, bp);
+            continue;
+        }
+        if (!locked) {
+            LOCK_ARENA(owner);
+            locked = 1;
+        }
+        slab_free(bp);
+    }
+    if (locked) UNLOCK_ARENA();
+    TCACHE_COUNT[i] -= count;
+}
+
+/*
+ * tcache_flush - give every object cached by the calling thread back to the heap.
+ * Registered as the destructor of TCACHE_KEY so it runs when a thread exits.
+ */
+static void tcache_flush(void* unused) {
+    (void) unused; //the key's value, only there to make the destructor run
+    if (TCACHE_GEN != HEAP_GEN) return; //the heap these came from is gone anyway
+
+    for (int i = 0; i < TCACHE_BINS; i++) {
+        tcache_release(i, TCACHE_COUNT[i]);
+    }
+}
+
+static void tcache_make_key(void) {
+    pthread_key_create(&TCACHE_KEY, tcache_flush);
+}
+
+/*
+ * tcache_check - make sure the calling thread's cache belongs to the current heap, emptying it
+ * if mm_init has been called since it was filled
+ */
+static void tcache_check(void) {
+    if (TCACHE_GEN == HEAP_GEN) return;
+
+    for (int i = 0; i < TCACHE_BINS; i++) {
+        TCACHE_BIN[i] = NULL;
+        TCACHE_COUNT[i] = 0;
+    }
+    TCACHE_GEN = HEAP_GEN;
+
+    //first time this thread touches the cache: have it flushed on thread exit
+    pthread_once(&TCACHE_ONCE, tcache_make_key);
+    pthread_setspecific(TCACHE_KEY, (void*) 1);
+}
+
+/*
+ * tcache_malloc - allocate a small object from the calling thread's cache.
+ * An empty bin is refilled with TCACHE_BATCH objects from the slab pages of our arena, so the lock
+ * is taken once per batch instead of once per call.
+ */
+static void* tcache_malloc(size_t size) {
+    int i = SLAB_CLASS(size);
+#ifdef PERCPU
+    if (pcpu_ready()) return pcpu_malloc(i, size);
+#endif
+    tcache_check();
+
+    if (TCACHE_BIN[i] == NULL) {
+        LOCK_ARENA(my_arena());
+        drain_remote_frees();
+        for (int n = 0; n < TCACHE_BATCH; n++) {
+            void* bp = slab_malloc(i);
+            if (bp == NULL) break;
+            TCACHE_NEXT(bp) = TCACHE_BIN[i];
+            TCACHE_BIN[i] = bp;
+            TCACHE_COUNT[i]++;
+        }
+        UNLOCK_ARENA();
+        if (TCACHE_BIN[i] == NULL) return arena_malloc(size); //our arena is full, let arena_malloc fall back
+    }
+
+    void* bp = TCACHE_BIN[i];
+    TCACHE_BIN[i] = TCACHE_NEXT(bp);
+    TCACHE_COUNT[i]--;
+    return bp;
+}
+
+/*
+ * tcache_free - put a slab object into the calling thread's cache, flushing TCACHE_BATCH objects
+ * back to the heap once the bin goes over TCACHE_LIMIT
+ */
+static void tcache_free(void* bp) {
+    int i = SLAB_CLASS(READ(SLAB_SIZEP(SLAB_PAGEP(bp))));
+#ifdef PERCPU
+    if (pcpu_ready()) {
+        pcpu_free(bp, i);
+        return;
+    }
+#endif
+    tcache_check();
+
+    TCACHE_NEXT(bp) = TCACHE_BIN[i];
+    TCACHE_BIN[i] = bp;
+    if (++TCACHE_COUNT[i] > TCACHE_LIMIT) tcache_release(i, TCACHE_BATCH);
+}
+#endif
+
+#ifdef PERCPU
+/* The pieces of a restartable sequence, the same way the kernel selftests and librseq lay them out:
+ * a descriptor (label 3) telling the kernel where the sequence starts (1), where its commit ends (2)
+ * and where to go if it's interrupted (4), and the abort handler at 4, which has to come right
+ * after RSEQ_SIG and just jumps to the C label abort so the caller can start over.
+ */
+#define RSEQ_STR_(x) #x
+#define RSEQ_STR(x) RSEQ_STR_(x)
+#define RSEQ_ENTER \
+    ".pushsection __rseq_cs, \"aw\"\n\t" \
+    ".balign 32\n\t" \
+    "3:\n\t" \
+    ".long 0x0, 0x0\n\t" \
+    ".quad 1f, (2f - 1f), 4f\n\t" \
+    ".popsection\n\t" \
+    "leaq 3b(%%rip), %%rax\n\t" \
+    "movq %%rax, %[rseq_cs]\n\t" \
+    "1:\n\t" \
+    "cmpl %[cpu], %[cpu_id]\n\t" /* still on the CPU whose cache we are looking at? */ \
+    "jnz 4f\n\t"
+#define RSEQ_ABORT \
+    ".pushsection __rseq_failure, \"ax\"\n\t" \
+    ".byte 0x0f, 0xb9, 0x3d\n\t" /* ud1 RSEQ_SIG(%%rip), %%edi, so the signature disassembles */ \
+    ".long " RSEQ_STR(RSEQ_SIG) "\n\t" \
+    "4:\n\t" \
+    "jmp %l[abort]\n\t" \
+    ".popsection\n\t"
+
+/*
+ * pcpu_init - set up the per-CPU caches, or empty them if they exist already. Leaves PCPU NULL if
+ * glibc couldn't register rseq, so every thread sticks to its thread cache.
+ */
+static void pcpu_init(void) {
+    if (__rseq_size == 0) return;
+
+    if (PCPU == NULL) {
+        int cpus = sysconf(_SC_NPROCESSORS_CONF);
+        void* caches = mmap(NULL, cpus*sizeof(pcpu_cache_t), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (caches == MAP_FAILED) return;
+        PCPU_CPUS = cpus;
+        PCPU = caches;
+        return;
+    }
+    for (int cpu = 0; cpu < PCPU_CPUS; cpu++) {
+        for (int i = 0; i < TCACHE_BINS; i++) {
+            PCPU[cpu].count[i] = 0;
+        }
+    }
+}
+
+/*
+ * pcpu_ready - whether the calling thread can use the per-CPU caches
+ */
+static int pcpu_ready(void) {
+    return PCPU != NULL && (int) RSEQ_AREA()->cpu_id >= 0 && RSEQ_AREA()->cpu_id < (unsigned int) PCPU_CPUS;
+}
+
+/*
+ * pcpu_pop - take the top object off bin i of the cache of the CPU we run on, NULL if it's empty
+ */
+static void* pcpu_pop(int i) {
+    struct rseq* rseq = RSEQ_AREA();
+    void* bp;
+
+    for (;;) {
+        unsigned int cpu = *(volatile unsigned int*) &rseq->cpu_id_start;
+        pcpu_cache_t* cache = &PCPU[cpu];
+
+        __asm__ __volatile__ goto (
+            RSEQ_ENTER
+            "movl %[count], %%ecx\n\t"
+            "testl %%ecx, %%ecx\n\t"
+            "jz %l[empty]\n\t"
+            "movq -8(%[slots], %%rcx, 8), %%rdx\n\t"
+            "movq %%rdx, (%[bpp])\n\t"
+            "decl %%ecx\n\t"
+            "movl %%ecx, %[count]\n\t" //commit
+            "2:\n\t"
+            RSEQ_ABORT
+            :
+            : [cpu] "r" (cpu), [cpu_id] "m" (rseq->cpu_id), [rseq_cs] "m" (rseq->rseq_cs),
+              [count] "m" (cache->count[i]), [slots] "r" (cache->slot[i]), [bpp] "r" (&bp)
+            : "memory", "cc", "rax", "rcx", "rdx"
+            : empty, abort);
+        return bp;
+    abort:
+        continue; //preempted, migrated or signalled: start over on whatever CPU we are on now
+    empty:
+        return NULL;
+    }
+}
+
+/*
+ * pcpu_push - put bp on top of bin i of the cache of the CPU we run on. Returns 0 if the bin is full
+ */
+static int pcpu_push(int i, void* bp) {
+    struct rseq* rseq = RSEQ_AREA();
+
+    for (;;) {
+        unsigned int cpu = *(volatile unsigned int*) &rseq->cpu_id_start;
+        pcpu_cache_t* cache = &PCPU[cpu];
+
+        __asm__ __volatile__ goto (
+            RSEQ_ENTER
+            "movl %[count], %%ecx\n\t"
+            "cmpl $" RSEQ_STR(PCPU_LIMIT) ", %%ecx\n\t"
+            "jae %l[full]\n\t"
+            "movq %[bp], (%[slots], %%rcx, 8)\n\t"
+            "incl %%ecx\n\t"
+            "movl %%ecx, %[count]\n\t" //commit
+            "2:\n\t"
+            RSEQ_ABORT
+            :
+            : [cpu] "r" (cpu), [cpu_id] "m" (rseq->cpu_id), [rseq_cs] "m" (rseq->rseq_cs),
+              [count] "m" (cache->count[i]), [slots] "r" (cache->slot[i]), [bp] "r" (bp)
+            : "memory", "cc", "rax", "rcx"
+            : full, abort);
+        return 1;
+    abort:
+        continue;
+    full:
+        return 0;
+    }
+}
+
+/*
+ * pcpu_release - give count objects back to the arenas they came from, the way tcache_release does
+ */
+static void pcpu_release(void** batch, int count) {
+    int locked = 0;
+
+    for (int n = 0; n < count; n++) {
+        arena_t* owner = owner_arena(batch[n]);
+        if (owner != my_arena()) {
+            remote_free(owner, batch[n]);
+            continue;
+        }
+        if (!locked) {
+            LOCK_ARENA(owner);
+            locked = 1;
+        }
+        slab_free(batch[n]);
+    }
+    if (locked) UNLOCK_ARENA();
+}
+
+/*
+ * pcpu_malloc - allocate an object of slab class i from the cache of the CPU we run on. An empty
+ * bin gets TCACHE_BATCH objects from the slab pages of our arena, under a single lock acquisition
+ */
+static void* pcpu_malloc(int i, size_t size) {
+    void* bp = pcpu_pop(i);
+    if (bp != NULL) return bp;
+
+    void* batch[TCACHE_BATCH];
+    int count = 0;
+    LOCK_ARENA(my_arena());
+    drain_remote_frees();
+    while (count < TCACHE_BATCH && (bp = slab_malloc(i)) != NULL) {
+        batch[count++] = bp;
+    }
+    UNLOCK_ARENA();
+    if (count == 0) return arena_malloc(size); //our arena is full, let arena_malloc fall back
+
+    //keep one, and cache the rest. Other threads may have filled the bin in the meantime
+    int n = 1;
+    while (n < count && pcpu_push(i, batch[n])) n++;
+    if (n < count) pcpu_release(batch + n, count - n);
+    return batch[0];
+}
+
+/*
+ * pcpu_free - put a slab object of class i into the cache of the CPU we run on. If the bin is
+ * full, it goes back to the heap along with TCACHE_BATCH - 1 objects taken off the bin
+ */
+static void pcpu_free(void* bp, int i) {
+    if (pcpu_push(i, bp)) return;
+
+    void* batch[TCACHE_BATCH];
+    int count = 0;
+    batch[count++] = bp;
+    while (count < TCACHE_BATCH && (bp = pcpu_pop(i)) != NULL) {
+        batch[count++] = bp;
+    }
+    pcpu_release(batch, count);
+}
+#endif
+
+/* What the heap walk of mm_checkheap found, for the checks of the lists and bins to add up against */
+typedef struct {
+    size_t free_blocks;
+    size_t alloc_blocks;
+    size_t listed; /* free blocks found on the lists and trees so far */
+    size_t unlisted; /* free blocks -DSIDE_LISTS couldn't find room for, see SIDE_UNLISTED */
+    size_t dirty_blocks;
+    size_t slab_pages;
+    size_t open_slabs[SLAB_CLASSES]; /* slab pages per class with room left */
+} check_t;
+
+/* Have the check that's running report what's wrong and fail, unless cond holds */
+#define CHECK(cond, bp, what) do { if (!(cond)) return check_failed(bp, what); } while (0)
+
+static int check_failed(void* bp, const char* what) {
+    if (bp) {
+        fprintf(stderr, "mm_checkheap: heap %d, block %p: %s\n", (int) HEAP_INDEX(), bp, what);
+    } else {
+        fprintf(stderr, "mm_checkheap: heap %d: %s\n", (int) HEAP_INDEX(), what);
+    }
+    return -1;
+}
+
+/*
+ * in_heap - whether bp could be a block of the current heap at all, so its header is safe to read
+ */
+static int in_heap(void* bp) {
+#ifdef BUDDY
+    void* first = BUDDY_BASE + WSIZE;
+#else
+    void* first = FREE_LISTS + HEAD_WORDS*WSIZE + 3*WSIZE; //past the prologue
+#endif
+    return bp >= first && bp < HEAP_BRK && ((unsigned long) bp & (DSIZE - 1)) == 0;
+}
+
+/*
+ * class_bit - whether the bitmap says the list of class is non-empty
+ */
+static int class_bit(int class) {
+#ifdef TLSF
+    return (READ(SL_BITMAPP(class / SL_COUNT)) >> (class % SL_COUNT)) & 1;
+#else
+    return (READ(BITMAPP) >> class) & 1;
+#endif
+}
+
+/*
+ * check_slab_page - check the descriptor of a slab page against its objects: the size is that of a
+ * slab class, and the free objects plus the ones in use add up to those carved out so far.
+ * Objects in thread or CPU caches and on remote free stacks count as in use.
+ */
+static int check_slab_page(void* page, check_t* c) {
+    unsigned int size = READ(SLAB_SIZEP(page));
+    CHECK(size > 0 && size <= SLAB_MAX_SIZE && SLAB_CLASS_SIZE(SLAB_CLASS(size)) == size, page, "slab page with a size that isn't a slab class");
+
+    unsigned int bump = READ(SLAB_BUMPP(page));
+    CHECK(bump >= SLAB_HDR_SIZE && bump <= SLAB_END && (bump - SLAB_HDR_SIZE) % size == 0, page, "slab page carved past its end, or between objects");
+
+    unsigned int carved = (bump - SLAB_HDR_SIZE)/size;
+    unsigned int free_objects = 0;
+    for (unsigned int off = READ(SLAB_FREEP(page)); off != 0; off = READ(page + off)) {
+        CHECK(off >= SLAB_HDR_SIZE && off < bump && (off - SLAB_HDR_SIZE) % size == 0, page, "slab page free list points outside its objects");
+        CHECK(++free_objects <= carved, page, "slab page free list has a cycle");
+    }
+    CHECK(READ(SLAB_USEDP(page)) + free_objects == carved, page, "slab page count of objects in use doesn't match its free list");
+
+    if (!slab_full(page)) c->open_slabs[SLAB_CLASS(size)]++;
+    c->slab_pages++;
+    return 0;
+}
+
+/*
+ * check_block - what every heap block is checked for, whatever the engine: an allocated one
+ * isn't marked as mapped, and is a whole slab page if the slab map says it is one
+ */
+static int check_block(void* bp, check_t* c) {
+    if (!GET_ALLOC(HDRP(bp))) {
+        c->free_blocks++;
+#ifdef PURGE_DECAY
+        if (IS_DIRTY(HDRP(bp))) c->dirty_blocks++;
+#endif
+        return 0;
+    }
+
+    CHECK(!IS_MAPPED(HDRP(bp)), bp, "heap block marked as mapped");
+    c->alloc_blocks++;
+    if (!slab_object(bp)) return 0;
+    CHECK(bp == SLAB_PAGEP(bp) && GET_SIZE(HDRP(bp)) >= SLAB_PAGE_SIZE, bp, "block in a page the slab map has as a slab page");
+    return check_slab_page(bp, c);
+}
+
+#ifdef BUDDY
+/*
+ * check_blocks - walk the blocks of the current heap. Each is a power of two in size at a multiple of
+ * that size from BUDDY_BASE, and a free one can't have a free whole buddy, or they'd have merged
+ */
+static int check_blocks(check_t* c) {
+    CHECK((size_t)(HEAP_BRK - BUDDY_BASE) % BUDDY_MAX_SIZE == 0, NULL, "heap doesn't end on a whole top-order block");
+
+    size_t size;
+    for (void* bp = BUDDY_BASE + WSIZE; HDRP(bp) < HEAP_BRK; bp += size) {
+        size = GET_SIZE(HDRP(bp));
+        CHECK(size >= MIN_BLOCK_SIZE && size <= BUDDY_MAX_SIZE && (size & (size - 1)) == 0, bp, "size isn't one of the orders");
+        CHECK(((size_t)(HDRP(bp) - BUDDY_BASE) & (size - 1)) == 0, bp, "block isn't at a multiple of its size from BUDDY_BASE");
+        CHECK(!GET_PREV_ALLOC(HDRP(bp)), bp, "prev-alloc bit set, which buddy headers never use");
+        if (!GET_ALLOC(HDRP(bp)) && size < BUDDY_MAX_SIZE) {
+            void* buddy = BUDDY_BLKP(bp, size);
+            CHECK(GET_ALLOC(HDRP(buddy)) || GET_SIZE(HDRP(buddy)) != size, bp, "free block with a free whole buddy");
+        }
+        if (check_block(bp, c)) return -1;
+    }
+    return 0;
+}
+#else
+/*
+ * check_blocks - walk the blocks of the current heap from the prologue to the epilogue. Every
+ * prev-alloc bit matches the block before, free blocks have a footer matching their header, and no
+ * two of them are next to each other
+ */
+static int check_blocks(check_t* c) {
+    void* bp = FREE_LISTS + HEAD_WORDS*WSIZE + WSIZE;
+    CHECK(READ(HDRP(bp)) == PACK(DSIZE, 1, 1) && READ(bp) == PACK(DSIZE, 1, 1), bp, "prologue overwritten");
+
+    size_t prev_alloc = 1;
+    for (bp = NEXT_BLKP(bp); GET_SIZE(HDRP(bp)) != 0; bp = NEXT_BLKP(bp)) {
+        size_t size = GET_SIZE(HDRP(bp));
+        CHECK(in_heap(bp) && size >= MIN_BLOCK_SIZE && bp + size <= HEAP_BRK, bp, "block runs past the end of the heap");
+        CHECK(GET_PREV_ALLOC(HDRP(bp)) == prev_alloc, bp, "prev-alloc bit doesn't match the block before");
+        if (!GET_ALLOC(HDRP(bp))) {
+            CHECK(prev_alloc, bp, "two free blocks in a row");
+            CHECK(READ(FTRP(bp)) == PACK(size, 0, 0), bp, "footer doesn't match the header");
+#ifdef SIDE_LISTS
+            if (get_class(size) != TREE_CLASS && READ(SIDE_INDEXP(bp)) == SIDE_UNLISTED) c->unlisted++;
+#endif
+        }
+        if (check_block(bp, c)) return -1;
+        prev_alloc = GET_ALLOC(HDRP(bp));
+    }
+    CHECK(bp == HEAP_BRK && READ(HDRP(bp)) == PACK(0, prev_alloc, 1), bp, "epilogue isn't at the end of the heap, or overwritten");
+    return 0;
+}
+#endif
+
+/*
+ * check_free - check that bp, found on the list or tree of class, is a free block of that class
+ */
+static int check_free(void* bp, int class, check_t* c) {
+    CHECK(in_heap(bp) && !GET_ALLOC(HDRP(bp)), bp, "on a free list but not a free block");
+    CHECK(get_class(GET_SIZE(HDRP(bp))) == class, bp, "on the free list of another class");
+    CHECK(++c->listed <= c->free_blocks, bp, "more blocks on the free lists than free in the heap, one has a cycle");
+    return 0;
+}
+
+#ifndef SIDE_LISTS
+/*
+ * check_list - check the doubly linked free list of class: every prev link points back, and with
+ * -DADDRESS_ORDER the blocks go up in address. With -DNEXT_FIT the rover is on it, if set
+ */
+static int check_list(int class, check_t* c) {
+    void* prev = NULL;
+#ifdef NEXT_FIT
+    void* rover = ROVER[HEAP_INDEX()][class];
+    int rover_found = rover == NULL;
+#endif
+
+    for (void* bp = GET_LINK(ROOTP(class)); bp != NULL; prev = bp, bp = GET_LINK(NEXTP(bp))) {
+        if (check_free(bp, class, c)) return -1;
+        CHECK(GET_LINK(PREVP(bp)) == prev, bp, "prev link doesn't point back at the block before");
+#ifdef ADDRESS_ORDER
+        CHECK(class == 0 || prev < bp, bp, "list out of address order");
+#endif
+#ifdef NEXT_FIT
+        if (bp == rover) rover_found = 1;
+#endif
+    }
+    CHECK(class_bit(class) == (GET_LINK(ROOTP(class)) != NULL), NULL, "bitmap bit doesn't match whether the list is empty");
+#ifdef NEXT_FIT
+    CHECK(rover_found, rover, "rover isn't on the list of its class");
+#endif
+    return 0;
+}
+#else
+/*
+ * check_side_array - check the side array of class: every entry is a free block of the class with
+ * the size the entry says, and that knows its index
+ */
+static int check_side_array(int class, check_t* c) {
+    unsigned int n = SIDE_COUNT[HEAP_INDEX()][class];
+    side_entry_t* list = SIDE_LIST[HEAP_INDEX()][class];
+
+    for (unsigned int i = 0; i < n; i++) {
+        void* bp = DECODE(list[i].off);
+        if (check_free(bp, class, c)) return -1;
+        CHECK(list[i].size == GET_SIZE(HDRP(bp)), bp, "side array entry has the wrong size");
+        CHECK(READ(SIDE_INDEXP(bp)) == i, bp, "block doesn't have its side array index");
+    }
+    CHECK(class_bit(class) == (n != 0), NULL, "bitmap bit doesn't match whether the side array is empty");
+    return 0;
+}
+#endif
+
+#if !defined(TLSF) && !defined(BUDDY)
+/*
+ * check_tree - check the subtree at t of the size tree, or of the address tree of class if by_addr
+ * is set: every key strictly between lo and hi, which also rules out cycles. Size tree nodes get
+ * checked and counted along with the list of their size. An address tree has to hold exactly the
+ * blocks of the list of its class, so its in-order walk is matched against the list, *next being
+ * how far along it has got.
+ */
+static int check_tree(void* t, size_t lo, size_t hi, int by_addr, int class, void** next, check_t* c) {
+    if (t == NULL) return 0;
+    CHECK(in_heap(t) && !GET_ALLOC(HDRP(t)), t, "in a tree but not a free block");
+    size_t key = KEY(t, by_addr);
+    CHECK(key > lo && key < hi, t, "tree out of order");
+
+    if (check_tree(GET_LINK(LEFTP(t, by_addr)), lo, key, by_addr, class, next, c)) return -1;
+    if (by_addr) {
+        CHECK(t == *next, t, "address tree doesn't hold the same blocks as the list of its class");
+        *next = GET_LINK(NEXTP(t));
+    } else {
+        void* prev = NULL;
+        for (void* bp = t; bp != NULL; prev = bp, bp = GET_LINK(NEXTP(bp))) {
+            if (check_free(bp, class, c)) return -1;
+            CHECK(GET_SIZE(HDRP(bp)) == key, bp, "on the list of a tree node of another size");
+            CHECK(GET_LINK(PREVP(bp)) == prev, bp, "prev link doesn't point back at the block before");
+        }
+    }
+    return check_tree(GET_LINK(RIGHTP(t, by_addr)), key, hi, by_addr, class, next, c);
+}
+#endif
+
+/*
+ * check_free_lists - check every list, tree and side array of the current heap, and the bitmaps,
+ * then that they hold every free block the heap walk found between them
+ */
+static int check_free_lists(check_t* c) {
+    for (int class = 0; class < NUM_LISTS; class++) {
+#if !defined(TLSF) && !defined(BUDDY)
+        if (class == TREE_CLASS) {
+            if (check_tree(GET_LINK(TREE_ROOTP), 0, SIZE_MAX, 0, class, NULL, c)) return -1;
+            CHECK(class_bit(class) == (GET_LINK(TREE_ROOTP) != NULL), NULL, "bitmap bit doesn't match whether the size tree is empty");
+            continue;
+        }
+#endif
+#ifdef SIDE_LISTS
+        if (check_side_array(class, c)) return -1;
+#else
+        if (check_list(class, c)) return -1;
+#endif
+#ifdef ADDRESS_ORDER
+        void* next = GET_LINK(ROOTP(class));
+        if (class > 0) {
+            if (check_tree(GET_LINK(ADDR_ROOTP(class)), 0, SIZE_MAX, 1, class, &next, c)) return -1;
+            CHECK(next == NULL, next, "on the list of its class but not in its address tree");
+        }
+#endif
+    }
+
+#ifdef TLSF
+    for (int fl = 0; fl < FL_COUNT; fl++) {
+        CHECK(((READ(FL_BITMAPP) >> fl) & 1) == (READ(SL_BITMAPP(fl)) != 0), NULL, "first-level bitmap bit doesn't match its second level");
+    }
+#else
+    CHECK(READ(BITMAPP) >> NUM_LISTS == 0, NULL, "bitmap bit set for a class that doesn't exist");
+#endif
+    CHECK(c->listed + c->unlisted == c->free_blocks, NULL, "free blocks in the heap that are on no list");
+    return 0;
+}
+
+/*
+ * check_slab_lists - check the lists of slab pages with room: they hold exactly the pages of their
+ * class that aren't full, and the slab map has no page marked that isn't a slab page
+ */
+static int check_slab_lists(check_t* c) {
+    int heap = HEAP_INDEX();
+
+    for (int class = 0; class < SLAB_CLASSES; class++) {
+        size_t n = 0;
+        void* prev = NULL;
+        for (void* page = GET_LINK(SLAB_ROOTP(class)); page != NULL; prev = page, page = GET_LINK(SLAB_NEXTP(page))) {
+            CHECK(in_heap(page) && slab_object(page) && page == SLAB_PAGEP(page), page, "on a slab list but not a slab page");
+            CHECK((int) SLAB_CLASS(READ(SLAB_SIZEP(page))) == class, page, "on the slab list of another class");
+            CHECK(!slab_full(page), page, "full slab page on a slab list");
+            CHECK(GET_LINK(SLAB_PREVP(page)) == prev, page, "prev link doesn't point back at the page before");
+            CHECK(++n <= c->open_slabs[class], page, "more pages on a slab list than slab pages with room, it has a cycle");
+        }
+        CHECK(n == c->open_slabs[class], NULL, "slab page with room that isn't on the list of its class");
+    }
+
+    size_t marked = 0;
+    for (unsigned int i = 0; i < (SLAB_MAP_TOP[heap] + 31)/32; i++) {
+        marked += __builtin_popcount(SLAB_MAP[heap][i]);
+    }
+    CHECK(marked == c->slab_pages, NULL, "slab map has a page marked that isn't the start of a slab page");
+    return 0;
+}
+
+/*
+ * check_bins - check the fast bins and the unsorted bin: they hold allocated blocks, of the bin's size
+ * for a fast bin, and add up to FAST_BLOCKS and UNSORTED_BYTES
+ */
+static int check_bins(check_t* c) {
+    int heap = HEAP_INDEX();
+    size_t binned = 0;
+
+    for (size_t size = FAST_MIN_SIZE; size <= FAST_MAX_SIZE; size += DSIZE) {
+        for (void* bp = GET_LINK(FAST_ROOTP(size)); bp != NULL; bp = GET_LINK(NEXTP(bp))) {
+            CHECK(in_heap(bp) && GET_ALLOC(HDRP(bp)) && !slab_object(bp), bp, "on a fast bin but not an allocated block");
+            CHECK(GET_SIZE(HDRP(bp)) == size, bp, "on the fast bin of another size");
+            CHECK(++binned <= c->alloc_blocks, bp, "more blocks in the bins than allocated ones, one has a cycle");
+        }
+    }
+    CHECK(binned == FAST_BLOCKS[heap], NULL, "FAST_BLOCKS doesn't match the fast bins");
+
+#ifdef DEFER_COALESCE
+    size_t bytes = 0;
+    for (void* bp = GET_LINK(UNSORTED_ROOTP); bp != NULL; bp = GET_LINK(NEXTP(bp))) {
+        CHECK(in_heap(bp) && GET_ALLOC(HDRP(bp)) && !slab_object(bp), bp, "on the unsorted bin but not an allocated block");
+        CHECK(++binned <= c->alloc_blocks, bp, "more blocks in the bins than allocated ones, one has a cycle");
+        bytes += GET_SIZE(HDRP(bp));
+    }
+    CHECK(bytes == UNSORTED_BYTES[heap], NULL, "UNSORTED_BYTES doesn't match the unsorted bin");
+#endif
+    return 0;
+}
+
+#ifdef PURGE_DECAY
+/*
+ * check_dirty_list - check the dirty list: doubly linked from head to tail, holding every free block
+ * that still needs purging and nothing else, and adding up to DIRTY_BYTES
+ */
+static int check_dirty_list(check_t* c) {
+    size_t n = 0, bytes = 0;
+    void* prev = NULL;
+
+    for (void* bp = GET_LINK(DIRTY_HEADP); bp != NULL; prev = bp, bp = GET_LINK(DIRTY_NEXTP(bp))) {
+        CHECK(in_heap(bp) && !GET_ALLOC(HDRP(bp)), bp, "on the dirty list but not a free block");
+        CHECK(IS_DIRTY(HDRP(bp)), bp, "on the dirty list but purged already, or too small to purge");
+        CHECK(GET_LINK(DIRTY_PREVP(bp)) == prev, bp, "prev link doesn't point back at the block before");
+        CHECK(++n <= c->dirty_blocks, bp, "more blocks on the dirty list than dirty ones, it has a cycle");
+        bytes += GET_SIZE(HDRP(bp));
+    }
+    CHECK(GET_LINK(DIRTY_TAILP) == prev, NULL, "dirty list tail isn't its last block");
+    CHECK(n == c->dirty_blocks, NULL, "dirty block that isn't on the dirty list");
+    CHECK(bytes == DIRTY_BYTES[HEAP_INDEX()], NULL, "DIRTY_BYTES doesn't match the dirty list");
+    return 0;
+}
+#endif
+
+/*
+ * check_heap - check the current heap, if it's been laid out yet
+ */
+static int check_heap(void) {
+    check_t c = {0};
+    if (FREE_LISTS == NULL) return 0;
+
+    CHECK(HEAP_BRK <= HEAP_TOP, NULL, "heap ends past the memory backing it");
+    if (check_blocks(&c) || check_free_lists(&c) || check_slab_lists(&c) || check_bins(&c)) return -1;
+#ifdef PURGE_DECAY
+    if (check_dirty_list(&c)) return -1;
+#endif
+    return 0;
+}
+
+/*
+ * mm_checkheap - check that every heap is consistent: the boundary tags and prev-alloc bits, the free
+ * lists, trees and side arrays along with the bitmaps, the buddy pairs, the slab pages, the fast and
+ * unsorted bins and the dirty list. Prints the first thing it finds wrong to stderr and returns -1,
+ * otherwise returns 0. It walks the whole of every heap, each under its arena's lock, so it's for
+ * debugging only.
+ */
+int mm_checkheap(void) {
+    for (int i = 0; i < NUM_HEAPS; i++) {
+#ifdef THREADS
+        LOCK_ARENA(&ARENAS[i]);
+#endif
+        int failed = check_heap();
+        UNLOCK_ARENA();
+        if (failed) return -1;
+    }
+    return 0;
 }
@@ -0,0 +1,87 @@
+/*
+ * memlib.c - a minimal stand-in for the memory system model malloc.c is written against.
+ * mem_init reserves MAX_HEAP bytes of address space up front, and mem_sbrk hands them out in
+ * order, failing once they run out. Pages only get used once touched. Where the system allows it,
+ * the region sits in the low 2GB of the address space, as it would in the lab's 32-bit model, so
+ * heap addresses fit in the 4-byte words malloc.c packs into its blocks.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "memlib.h"
+
+#ifdef MAP_32BIT
+#define LOW_ADDRESSES MAP_32BIT
+#else
+#define LOW_ADDRESSES 0
+#endif
+
+#ifndef MAX_HEAP
+#define MAX_HEAP (512*(1 << 20)) /* 512MB. Can be set with -DMAX_HEAP=... */
+#endif
+
+static char* mem_start_brk; /* first byte of the heap */
+static char* mem_brk; /* one past the last byte of the heap */
+static char* mem_max_addr; /* one past the last byte mem_sbrk may hand out */
+
+/*
+ * mem_init - reserve the region mem_sbrk works in
+ */
+void mem_init(void) {
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE | LOW_ADDRESSES;
+    mem_start_brk = mmap(NULL, MAX_HEAP, PROT_READ | PROT_WRITE, flags, -1, 0);
+    if (mem_start_brk == MAP_FAILED) {
+        perror("mem_init");
+        exit(1);
+    }
+    mem_max_addr = mem_start_brk + MAX_HEAP;
+    mem_brk = mem_start_brk;
+}
+
+/*
+ * mem_deinit - give the region back
+ */
+void mem_deinit(void) {
+    munmap(mem_start_brk, MAX_HEAP);
+}
+
+/*
+ * mem_sbrk - extend the heap by incr bytes and return the start of the new area.
+ * The heap can't shrink.
+ */
+void* mem_sbrk(int incr) {
+    char* old_brk = mem_brk;
+
+    if (incr < 0 || mem_brk + incr > mem_max_addr) {
+        errno = ENOMEM;
+        fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
+        return (void*) -1;
+    }
+    mem_brk += incr;
+    return old_brk;
+}
+
+/*
+ * mem_reset_brk - make the heap empty again
+ */
+void mem_reset_brk(void) {
+    mem_brk = mem_start_brk;
+}
+
+void* mem_heap_lo(void) {
+    return mem_start_brk;
+}
+
+void* mem_heap_hi(void) {
+    return mem_brk - 1;
+}
+
+size_t mem_heapsize(void) {
+    return mem_brk - mem_start_brk;
+}
+
+size_t mem_pagesize(void) {
+    return getpagesize();
+}
@@ -0,0 +1,19 @@
+#ifndef MEMLIB_H
+#define MEMLIB_H
+
+#include <stddef.h>
+
+/*
+ * memlib.h - a minimal stand-in for the memory system model malloc.c is written against, so the
+ * benchmarks next to it can be built on their own. See memlib.c.
+ */
+void mem_init(void);
+void mem_deinit(void);
+void* mem_sbrk(int incr);
+void mem_reset_brk(void);
+void* mem_heap_lo(void);
+void* mem_heap_hi(void);
+size_t mem_heapsize(void);
+size_t mem_pagesize(void);
+
+#endif